@@ -94,7 +94,9 @@ def rmsd_calculation(vinamol2_path: str,
         "DockRMSD_optimal_mapping": DockRMSD.optimal_mapping,  # str
         "DockRMSD_total_of_possible_mappings":
         DockRMSD.total_of_possible_mappings,
-        "DockRMSD_error": DockRMSD.error}
+        "DockRMSD_error": DockRMSD.error,
+        "DockRMSD_setup_seconds": DockRMSD.setup_seconds,
+        "DockRMSD_search_seconds": DockRMSD.search_seconds}
     return pandas.DataFrame(data=[result])
 
 
@@ -133,6 +135,9 @@ result_df["docked_mol_json"] = result_df["docked_mol"].map(MolToJSON)
 # %%
 result_df
 # %%
+timing_col = ["DockRMSD_setup_seconds", "DockRMSD_search_seconds"]
+print(result_df[timing_col].sum())
+# %%
 result_df.drop(columns=["crystal_mol", "docked_mol"], errors="ignore") \
     .to_parquet("dockrmsd_example.parquet")
 # %%
@@ -140,7 +145,7 @@ result_df_2 = result_df.copy()
 # %%
 drop_col = ["crystal_mol", "docked_mol",
             "docked_mol_json", "crystal_mol_json",
-            "crystal_mol2_path", "vinamol2_path", "protein"]
+            "crystal_mol2_path", "vinamol2_path", "protein"] + timing_col
 comparedf = (result_df.drop(columns=drop_col, errors="ignore") ==
              pandas.read_parquet("dockrmsd_example-sav.parquet")
              .drop(columns=drop_col, errors="ignore"))
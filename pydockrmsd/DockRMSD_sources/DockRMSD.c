@@ -4,6 +4,26 @@
 #include <stdarg.h>  /* needed for va_list */
 #include <math.h>    /* pow */
 #include <string.h>  /* strcpy, strcat, strlen, memcpy */
+#include <stdint.h>  /* uint64_t */
+#ifdef _WIN32
+#include <windows.h> /* CreateFileMapping, MapViewOfFile */
+#else
+#include <pthread.h>  /* pthread_create, pthread_mutex_lock */
+#include <time.h>     /* clock_gettime */
+#include <fcntl.h>    /* open */
+#include <sys/mman.h> /* mmap */
+#include <sys/stat.h> /* fstat */
+#include <unistd.h>   /* close */
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h> /* AVX2 and AVX-512 distance kernels, picked at runtime by distKernel */
+#define SIMDKERNELS
+#ifdef __clang__
+#define NOCONTRACT
+#else
+#define NOCONTRACT __attribute__((optimize("fp-contract=off"))) // AVX-512 brings FMA, which rounds differently
+#endif
+#endif
 #define HFLAG 0      // Remove Hydrogenes
 #define SIMPLEFLAG 0 // Less is more
 /*
@@ -66,804 +86,3884 @@ int asprintf(char *strp[], const char *fmt, ...)
 }
 #endif // asprintf
 
-#define MAXBONDS 6        // Maximum number of bonds allowable on a single atom
 #define MAXLINELENGTH 150 // Maximum length (in characters) of a line in a mol2 file
 #define MAXMAPCOUNT 0     // Maximum amount of possible mappings before symmetry heuristic is used
-#define MAXDEPTH 2
+#define MAXDEPTH 2      // Default depth of the bonding trees compared to prune candidates
+#define ADAPTIVEDEPTH 0 // Depth option deepening the bonding trees until they stop telling apart more atoms
+#define MAPPINGCOLUMNS 3 // Ints per query atom in DockRMSD.mapping
 
 typedef struct DockRMSD
 {
     double rmsd;
     double total_of_possible_mappings;
+    // Text of the mapping, empty until dock_rmsd_mapping_text renders it
     char *optimal_mapping;
     char *error;
     // Number of atom in query
     int _querycount;
     // Number of atom in template
     int _tempcount;
+    // Seconds spent preparing the mapping search (template trees, candidates, distances, seed) and searching
+    double setup_seconds;
+    double search_seconds;
+    // 1 when error was allocated for this result, see dock_rmsd_free
+    int _errorowned;
+    // Optimal mapping, NULL if none was found: a row of MAPPINGCOLUMNS ints per query atom, the template atom it is mapped
+    // on (index in the order atoms were read) then the mol2 numbers of both atoms, followed by the query atom elements
+    int *mapping;
+    // Threshold mode: 1 if the mapping found is within DockRMSDOptions.threshold
+    int within_threshold;
+    // 1 if rmsd is proven to be the lowest, 0 if a search limit, the threshold mode or a bound stopped the search first
+    int optimal;
+    // RMSD no mapping is below, rmsd itself when it is optimal
+    double lower_bound;
 } DockRMSD;
 
-int grabAtomCount(FILE *mol2, int hflag);
-int arrayIdentity(char **arr1, char **arr2, int arrlen);
+// Parsed content of a mol2 file
+typedef struct Molecule
+{
+    int atomcount;
+    int *elements; // Element code of every atom, see elementCode
+    // Coordinates of every atom, one array per axis
+    double *x;
+    double *y;
+    double *z;
+    int *nums;
+    // Bonding network as adjacency lists: neighbors[bondstarts[i]] to neighbors[bondstarts[i + 1] - 1] are bonded to atom i
+    int *bondstarts;
+    int *neighbors;
+    int *bondtypes; // Bond type code of every entry of neighbors, see bondCode
+} Molecule;
+
+// Element symbols, the index in elementnames is their atomic number and the code of the element
+static const char *const elementnames[] = {
+    "", "H", "He", "Li", "Be", "B", "C", "N", "O", "F", "Ne", "Na", "Mg", "Al", "Si", "P", "S", "Cl", "Ar",
+    "K", "Ca", "Sc", "Ti", "V", "Cr", "Mn", "Fe", "Co", "Ni", "Cu", "Zn", "Ga", "Ge", "As", "Se", "Br", "Kr",
+    "Rb", "Sr", "Y", "Zr", "Nb", "Mo", "Tc", "Ru", "Rh", "Pd", "Ag", "Cd", "In", "Sn", "Sb", "Te", "I", "Xe",
+    "Cs", "Ba", "La", "Ce", "Pr", "Nd", "Pm", "Sm", "Eu", "Gd", "Tb", "Dy", "Ho", "Er", "Tm", "Yb", "Lu",
+    "Hf", "Ta", "W", "Re", "Os", "Ir", "Pt", "Au", "Hg", "Tl", "Pb", "Bi", "Po", "At", "Rn",
+    "Fr", "Ra", "Ac", "Th", "Pa", "U", "Np", "Pu", "Am", "Cm", "Bk", "Cf", "Es", "Fm", "Md", "No", "Lr",
+    "Rf", "Db", "Sg", "Bh", "Hs", "Mt", "Ds", "Rg", "Cn", "Nh", "Fl", "Mc", "Lv", "Ts", "Og"};
+#define ELEMENTNAMES 119
+
+// Bond types of the mol2 format, the index in bondnames is their code and 0 means no bond
+static const char *const bondnames[] = {"", "1", "2", "3", "am", "ar", "du", "un", "nc", "b"};
+#define BONDGENERAL 9 // Generic bond read in place of every bond type when they don't agree between query and template
+#define BONDNAMES 10
+
+// Streaming reader over the @<TRIPOS>MOLECULE blocks of a mol2 file or of an in-memory mol2 buffer
+typedef struct Mol2Reader
+{
+    FILE *mol2;       // Source file, NULL when reading from data
+    const char *data; // Source buffer, never modified
+    size_t size;
+    size_t offset; // Position of the next line in data
+    char line[MAXLINELENGTH];
+    int pending; // 1 when line already holds the header of the next molecule, without its line ending
+} Mol2Reader;
+
+// Read-only mapping of a whole mol2 file, see dock_rmsd_map
+typedef struct Mol2Map
+{
+    const char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} Mol2Map;
+
+// Mol2 input of a batch: a file path, or a buffer when path is NULL
+typedef struct Mol2Source
+{
+    const char *path;
+    const char *data;
+    size_t size;
+} Mol2Source;
+
+// Settings of the comparisons against a reference, see dock_rmsd_default_options
+typedef struct DockRMSDOptions
+{
+    int depth;     // Depth of the bonding trees compared to prune candidates, ADAPTIVEDEPTH to pick it from the reference
+    int hungarian; // 1 for the RMSD of the optimal assignment of same element atoms, ignoring the bonds
+    int threads;   // Threads sharing the mapping search of one pose, 0 for one per core, 1 by default
+    // Threshold mode when positive: the search only tells whether the RMSD is within this cutoff, it stops at the first
+    // mapping within it or when a lower bound proves there is none, and returns the best mapping found so far
+    double threshold;
+    // Limits of the mapping search of one pose, 0 for none: nodes visited by all its threads or by the search over the
+    // automorphisms, and seconds, the clock being read every LIMITCHECK nodes. When one is reached the best mapping
+    // found so far is returned, not proven optimal
+    long long maxnodes;
+    double timelimit;
+} DockRMSDOptions;
+
+// Automorphism group of a molecule as a stabilizer chain: for every level, the base atom of the level and one
+// automorphism fixing the previous base atoms per atom the base atom can be moved to (transversal)
+typedef struct Symmetry
+{
+    int levels;  // Number of base atoms, -1 when the group is unknown
+    int *base;   // Base atom of every level
+    int *starts; // Transversal of level l: permutations starts[l] to starts[l + 1] - 1, the first being the identity
+    int *perms;  // Permutations of the atoms, perms[p * atomcount + atom] is the image of atom
+    int *orbits; // Smallest atom of the orbit of every atom under the stabilizer of the first l base atoms
+    int *cycles; // Next atom of the same orbit, circularly, orbits and cycles being indexed by l * atomcount + atom
+} Symmetry;
+
+#define QUERYREADERROR "Error: Query file can't be read!"
+#define TEMPLATEREADERROR "Error: Template file can't be read!"
+#define QUERYMOLECULEERROR "Error: Query file has no molecule!"
+
+// Reference molecule parsed once and reused against many poses
+typedef struct DockRMSDReference
+{
+    Molecule mol;
+    int *sortedatoms;   // Element codes of the reference, sorted for the atom identity check
+    int *sortedbonds;   // Bond type codes of the reference, sorted for the bonding network identity check
+    int bondcount;      // Number of entries in sortedbonds
+    DockRMSDOptions options;
+    int depth;       // Depth of the bonding trees in trees, chosen by adaptiveDepth in adaptive mode
+    uint64_t *trees; // Bonding tree hashes of every atom at every depth, indexed with treeIndex
+    // Automorphisms of the reference preserving its bonding trees, with and without bond types
+    Symmetry symmetry[2];
+    double possiblemaps; // Candidate mappings of a pose numbering its atoms as the reference, see symmetryAssign
+} DockRMSDReference;
+
+#define ARENABLOCK 65536 // Bytes of the first block of an Arena, the next ones doubling
+
+// Block of an Arena, its memory follows the header
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next; // Previous block, full
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+// Bump allocator of the scratch memory of one comparison: allocations are never freed one by one, arenaFree
+// releases all of them at once, whatever path the comparison returned from
+typedef struct Arena
+{
+    ArenaBlock *head;
+} Arena;
+
+// Node and time limits of a mapping search, shared by all its walks
+typedef struct SearchLimits
+{
+    long long maxnodes; // Nodes the search may visit, 0 for no limit
+    double deadline;    // wallSeconds after which the search stops, 0 for no limit
+    int64_t nodes;      // Nodes visited, added by the walks LIMITCHECK at a time
+    int truncated;      // Set when a limit stopped the search
+} SearchLimits;
+
 int inArray(int n, int *arr, int arrlen);
-void readMol2(char **atoms, double **coords, char ***bonds, int *nums, FILE *mol2, int atomcount, int hflag);
-int generalizeBonds(char ***bonds, int atomcount);
-char **buildTree(int depth, int index, char **atoms, char ***bonds, char *prestring, int prevind, int atomcount);
-double searchAssigns(int atomcount, int **allcands, int candcounts[], int *assign, char ***tempbond, char ***querybond, double **querycoord, double **tempcoord, int *bestassign);
-DockRMSD assignAtoms(char **tempatom, char ***tempbond, char **queryatom, char ***querybond, double **querycoord, double **tempcoord, int *querynums, int *tempnums, int atomcount, int simpleflag, DockRMSD rmsd);
-int validateBonds(int *atomassign, int proposedatom, int assignpos, char ***querybond, char ***tempbond, int atomcount);
-DockRMSD make_and_send_point(FILE *query, FILE *template);
+Mol2Reader fileReader(FILE *mol2);
+Mol2Reader bufferReader(const char *data, size_t size);
+int readNextMolecule(Mol2Reader *reader, Molecule *mol, int hflag);
+void freeMolecule(Molecule *mol);
+void treeHashes(const Molecule *mol, int mindepth, int maxdepth, int generalflag, uint64_t *hashes);
+double searchAssigns(int atomcount, int **allcands, int candcounts[], const Molecule *temp, const Molecule *query, const Symmetry *symmetry, const DockRMSDOptions *options, double bound, int *bestassign, DockRMSD *rmsd, Arena *arena);
+int cpuCount(void);
+double wallSeconds(void);
+void parallelFor(int count, int nthreads, void (*job)(void *, int), void *context);
+DockRMSD scorePose(const DockRMSDReference *ref, Molecule *temp, const uint64_t *temptrees, double bound);
+const uint64_t *templateTrees(const DockRMSDReference *ref, const Molecule *temp, const uint64_t *temptrees, int generalflag, uint64_t *hashes);
+DockRMSD assignAtoms(const DockRMSDReference *ref, Molecule *temp, const uint64_t *temptrees, double bound, int generalflag, int simpleflag, DockRMSD rmsd, Arena *arena);
+int validateBonds(int *atomassign, int proposedatom, int assignpos, const Molecule *query, const Molecule *temp);
+double lapSolve(int n, const double *cost, int *rowassign, Arena *arena);
+double classAssign(int atomcount, int **allcands, int candcounts[], double **dists, int *lapassign, Arena *arena);
+double repairAssign(int atomcount, int **allcands, int candcounts[], double **dists, const int *lapassign, const Molecule *query, const Molecule *temp, int *mapping, Arena *arena);
+DockRMSD hungarianAssign(const DockRMSDReference *ref, Molecule *temp, DockRMSD rmsd, Arena *arena);
+int *mappingRows(const Molecule *query, const Molecule *temp, const int *assign);
+int refineColors(const Molecule *mol, uint64_t *colors);
+int matchColorings(const Molecule *mol, const uint64_t *initial, uint64_t *source, uint64_t *target, int *perm, long long *budget);
+int buildSymmetry(const Molecule *mol, const uint64_t *initial, Symmetry *symmetry);
+void freeSymmetry(Symmetry *symmetry);
+int samePartition(const uint64_t *first, const uint64_t *second, int atomcount);
+void copySymmetry(Symmetry *copy, const Symmetry *symmetry, int atomcount);
+double symmetricSearch(const Symmetry *symmetry, const Molecule *query, const Molecule *temp, int *mapping, SearchLimits *limits, double *lowerTotal, Arena *arena);
+uint64_t moleculeKey(const Molecule *mol);
+int sameGraph(const Molecule *first, const Molecule *second);
+int cachedSymmetry(const Molecule *mol, int depth, Symmetry symmetry[2]);
+void cacheSymmetry(const Molecule *mol, int depth, const Symmetry symmetry[2]);
+int sameNumbering(const Molecule *query, const Molecule *temp);
+DockRMSD symmetryAssign(const DockRMSDReference *ref, Molecule *temp, DockRMSD rmsd, Arena *arena);
+void setError(DockRMSD *rmsd, char *error, int owned);
+void dock_rmsd_free(DockRMSD *rmsd);
+const char *dock_rmsd_mapping_text(DockRMSD *rmsd);
+DockRMSDReference *dock_rmsd_reference(FILE *reference);
+DockRMSDReference *dock_rmsd_reference_buffer(const char *data, size_t size);
+DockRMSD dock_rmsd_pose(const DockRMSDReference *ref, FILE *pose);
+DockRMSD dock_rmsd_pose_buffer(const DockRMSDReference *ref, const char *data, size_t size);
+void dock_rmsd_reference_free(DockRMSDReference *ref);
+int dock_rmsd_reference_symmetry(const DockRMSDReference *ref, int *classes);
+void dock_rmsd_clear_cache(void);
+DockRMSDOptions dock_rmsd_default_options(void);
+int dock_rmsd_reference_set_options(DockRMSDReference *ref, const DockRMSDOptions *options);
+DockRMSD dock_rmsd_buffer(const char *query, size_t querysize, const char *template, size_t templatesize);
+int dock_rmsd_map(const char *path, Mol2Map *map);
+void dock_rmsd_unmap(Mol2Map *map);
+void dock_rmsd_batch(const Mol2Source *queries, const Mol2Source *templates, DockRMSD *results, int count, int nthreads, const DockRMSDOptions *options);
+void dock_rmsd_pairwise(const Mol2Source *poses, int count, double *condensed, int nthreads, const DockRMSDOptions *options);
+int dock_rmsd_top_k(const DockRMSDReference *ref, const Mol2Source *poses, int count, int k, int nthreads, DockRMSD *results, int *indices);
+Mol2Reader *dock_rmsd_stream(FILE *poses);
+Mol2Reader *dock_rmsd_stream_buffer(const char *data, size_t size);
+int dock_rmsd_stream_next(const DockRMSDReference *ref, Mol2Reader *reader, DockRMSD *rmsd);
+void dock_rmsd_stream_free(Mol2Reader *reader);
 
 struct DockRMSD dock_rmsd(FILE *query, FILE *template)
 {
-    int querycount = grabAtomCount(query, HFLAG);
-    int tempcount = grabAtomCount(template, HFLAG);
-    DockRMSD rmsd = {0, 0, "", "", querycount, tempcount};
+    DockRMSDReference *ref = dock_rmsd_reference(query);
+    DockRMSD rmsd = {0, 0, "", QUERYMOLECULEERROR, 0, 0, 0, 0, 0, NULL, 0, 0, 0};
+    if (ref)
+    {
+        rmsd = dock_rmsd_pose(ref, template);
+    }
+    dock_rmsd_reference_free(ref);
+    fclose(query);
+    fclose(template);
+    return rmsd;
+}
 
-    if (querycount != tempcount)
+// Same as dock_rmsd for two mol2 files already in memory
+DockRMSD dock_rmsd_buffer(const char *query, size_t querysize, const char *template, size_t templatesize)
+{
+    DockRMSDReference *ref = dock_rmsd_reference_buffer(query, querysize);
+    DockRMSD rmsd = {0, 0, "", QUERYMOLECULEERROR, 0, 0, 0, 0, 0, NULL, 0, 0, 0};
+    if (ref)
     {
-        rmsd.error = "Error: Query and template don't have the same atom count!";
-        return rmsd;
+        rmsd = dock_rmsd_pose_buffer(ref, template, templatesize);
     }
-    if (querycount == 0)
+    dock_rmsd_reference_free(ref);
+    return rmsd;
+}
+
+// Index of the bonding tree hash of an atom at a given depth in DockRMSDReference.trees
+static inline int treeIndex(const DockRMSDReference *ref, int generalflag, int depth, int index)
+{
+    return ((generalflag * ref->depth) + depth - 1) * ref->mol.atomcount + index;
+}
+
+#define HASHPRIME 0x1fffffffffffffffULL // 2^61 - 1
+
+// Bijective 64 bits mixer of splitmix64
+static inline uint64_t mixHash(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Returns a * b modulo HASHPRIME for a, b < HASHPRIME
+static inline uint64_t mulMod(uint64_t a, uint64_t b)
+{
+    // 128 bits product from 32 bits halves, then 2^64 = 8 modulo 2^61 - 1
+    uint64_t a0 = a & 0xffffffff, a1 = a >> 32, b0 = b & 0xffffffff, b1 = b >> 32;
+    uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0;
+    uint64_t mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+    uint64_t lo = (mid << 32) | (p00 & 0xffffffff);
+    uint64_t hi = a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+    uint64_t r = (lo & HASHPRIME) + (lo >> 61) + (hi << 3);
+    r = (r & HASHPRIME) + (r >> 61);
+    return r >= HASHPRIME ? r - HASHPRIME : r;
+}
+
+static inline uint64_t addMod(uint64_t a, uint64_t b)
+{
+    uint64_t r = a + b;
+    return r >= HASHPRIME ? r - HASHPRIME : r;
+}
+
+// Returns the non-zero hash of an atom reached through a bond at a given position of a bonding tree path
+static inline uint64_t tokenHash(int position, int bondtype, int element)
+{
+    uint64_t x = ((uint64_t)position << 40) ^ ((uint64_t)bondtype << 20) ^ (uint64_t)element;
+    return mixHash(x) % (HASHPRIME - 1) + 1;
+}
+
+// Comparator for compatibility with qsort
+int intcompar(const void *a, const void *b) { return (*(int *)a > *(int *)b) - (*(int *)a < *(int *)b); }
+
+// Returns a sorted copy of an array of codes
+int *sortedCopy(const int *arr, int arrlen)
+{
+    int *list = (int *)malloc(sizeof(int) * (arrlen + 1));
+    if (arrlen)
     {
-        rmsd.error = "Error: Query file has no atoms!";
-        return rmsd;
+        memcpy(list, arr, sizeof(int) * arrlen);
     }
-    if (tempcount == 0)
+    qsort(list, arrlen, sizeof(list[0]), intcompar);
+    return list;
+}
+
+// Returns the sorted bond type codes of a molecule, each bond being listed from both of its atoms
+int *sortedBonds(Molecule *mol, int *bondcount)
+{
+    *bondcount = mol->bondstarts[mol->atomcount];
+    return sortedCopy(mol->bondtypes, *bondcount);
+}
+
+// Parses the reference molecule and precomputes everything that does not depend on the poses, NULL if there is no
+// molecule to read or memory is exhausted
+DockRMSDReference *prepareReference(Mol2Reader *reader)
+{
+    DockRMSDReference *ref = (DockRMSDReference *)calloc(1, sizeof(DockRMSDReference));
+    if (!ref)
     {
-        rmsd.error = "Error: Template file has no atoms!";
-        return rmsd;
+        return NULL;
     }
-    // Initialize pointer arrays and fill them with information from the mol2 files
-    char **queryatoms = (char **)malloc(querycount * sizeof(char *));
-    double **querycoords = (double **)malloc(querycount * sizeof(double *));
-    char ***querybonds = (char ***)malloc(querycount * sizeof(char **));
-    char **tempatoms = (char **)malloc(tempcount * sizeof(char *));
-    double **tempcoords = (double **)malloc(tempcount * sizeof(double *));
-    char ***tempbonds = (char ***)malloc(tempcount * sizeof(char **));
-    int *querynums = (int *)malloc(querycount * sizeof(int));
-    int *tempnums = (int *)malloc(tempcount * sizeof(int));
-    // Loop allocation
-    for (int i = 0; i < querycount; i++)
-    {
-        char *queryatom = (char *)malloc(3 * sizeof(char));
-        *(queryatoms + i) = queryatom;
-        char *tempatom = (char *)malloc(3 * sizeof(char));
-        *(tempatoms + i) = tempatom;
-        double *querycoord = (double *)malloc(3 * sizeof(double));
-        *(querycoords + i) = querycoord;
-        double *tempcoord = (double *)malloc(3 * sizeof(double));
-        *(tempcoords + i) = tempcoord;
-        char **querybondrow = (char **)malloc(querycount * sizeof(char *));
-        char **tempbondrow = (char **)malloc(tempcount * sizeof(char *));
-        for (int j = 0; j < querycount; j++)
-        {
-            char *querybond = (char *)malloc(3 * sizeof(char));
-            strcpy(querybond, "");
-            *(querybondrow + j) = querybond;
-            char *tempbond = (char *)malloc(3 * sizeof(char));
-            strcpy(tempbond, "");
-            *(tempbondrow + j) = tempbond;
-        }
-        *(querybonds + i) = querybondrow;
-        *(tempbonds + i) = tempbondrow;
-    }
-    readMol2(queryatoms, querycoords, querybonds, querynums, query, querycount, HFLAG);
-    readMol2(tempatoms, tempcoords, tempbonds, tempnums, template, tempcount, HFLAG);
-    fclose(query);
-    fclose(template);
-    if (!arrayIdentity(queryatoms, tempatoms, querycount))
+    if (!readNextMolecule(reader, &ref->mol, HFLAG))
+    { // No molecule to read
+        dock_rmsd_reference_free(ref);
+        return NULL;
+    }
+    int atomcount = ref->mol.atomcount;
+    ref->sortedatoms = sortedCopy(ref->mol.elements, atomcount);
+    ref->sortedbonds = sortedBonds(&ref->mol, &ref->bondcount);
+    DockRMSDOptions options = dock_rmsd_default_options();
+    if (!dock_rmsd_reference_set_options(ref, &options))
     {
-        rmsd.error = "Template and query don't have the same atoms.";
-        return rmsd;
+        dock_rmsd_reference_free(ref);
+        return NULL;
     }
+    return ref;
+}
+
+DockRMSDOptions dock_rmsd_default_options(void)
+{
+    DockRMSDOptions options;
+    memset(&options, 0, sizeof(DockRMSDOptions));
+    options.depth = MAXDEPTH;
+    options.threads = 1;
+    return options;
+}
+
+// Comparator for compatibility with qsort
+int hashcompar(const void *a, const void *b) { return (*(uint64_t *)a > *(uint64_t *)b) - (*(uint64_t *)a < *(uint64_t *)b); }
 
-    char **flatquerybonds = malloc(sizeof(char *) * (querycount * querycount));
-    char **flattempbonds = malloc(sizeof(char *) * (tempcount * tempcount));
-    for (int i = 0; i < querycount; i++)
+// Returns the number of distinct values of an array, which is sorted in place
+int distinctCount(uint64_t *values, int count)
+{
+    qsort(values, count, sizeof(values[0]), hashcompar);
+    int distinct = count ? 1 : 0;
+    for (int i = 1; i < count; i++)
     {
-        memcpy(flatquerybonds + querycount * i, *(querybonds + i), sizeof(char *) * querycount);
-        memcpy(flattempbonds + tempcount * i, *(tempbonds + i), sizeof(char *) * tempcount);
+        distinct += values[i] != values[i - 1];
     }
-    if (!arrayIdentity(flatquerybonds, flattempbonds, querycount * querycount))
+    return distinct;
+}
+
+// Returns the depth from which deeper bonding trees stop splitting the atoms of a molecule into more classes
+// Atoms are classed by their element and their trees at every depth up to the current one, like color refinement
+// The number of classes can only grow and is bounded by the atom count, so the loop ends
+int adaptiveDepth(const Molecule *mol)
+{
+    int atomcount = mol->atomcount;
+    uint64_t *classes = (uint64_t *)malloc(sizeof(uint64_t) * (2 * atomcount + 1)); // Both bond modes side by side
+    uint64_t *hashes = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *sorted = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    int counts[2];
+    for (int generalflag = 0; generalflag < 2; generalflag++)
     {
-        // Remove bond typing if they don't agree between query and template
-        generalizeBonds(querybonds, querycount);
-        generalizeBonds(tempbonds, tempcount);
-        for (int i = 0; i < querycount; i++)
+        for (int i = 0; i < atomcount; i++)
         {
-            memcpy(flatquerybonds + querycount * i, *(querybonds + i), sizeof(char *) * querycount);
-            memcpy(flattempbonds + tempcount * i, *(tempbonds + i), sizeof(char *) * tempcount);
+            classes[generalflag * atomcount + i] = (uint64_t)mol->elements[i];
         }
-        // If the general bonds still don't agree, the molecules aren't the same
-        if (!arrayIdentity(flatquerybonds, flattempbonds, querycount * querycount))
+        memcpy(sorted, classes + generalflag * atomcount, sizeof(uint64_t) * atomcount);
+        counts[generalflag] = distinctCount(sorted, atomcount);
+    }
+    int depth = 1;
+    while (1)
+    {
+        int refined = 0;
+        for (int generalflag = 0; generalflag < 2; generalflag++)
         {
-            rmsd.error = "Template and query don't have the same bonding network.";
-            return rmsd;
+            uint64_t *class = classes + generalflag * atomcount;
+            treeHashes(mol, depth, depth, generalflag, hashes);
+            for (int i = 0; i < atomcount; i++)
+            { // The class of an atom at this depth is its previous class and its new tree
+                class[i] = mixHash(class[i] ^ mixHash(hashes[i]));
+            }
+            memcpy(sorted, class, sizeof(uint64_t) * atomcount);
+            int count = distinctCount(sorted, atomcount);
+            refined |= count > counts[generalflag];
+            counts[generalflag] = count;
+        }
+        if (!refined)
+        { // This depth doesn't tell apart more atoms than the previous one
+            break;
         }
+        depth++;
     }
-    free(flatquerybonds);
-    free(flattempbonds);
-    return assignAtoms(tempatoms, tempbonds, queryatoms, querybonds, querycoords, tempcoords, querynums, tempnums, querycount, SIMPLEFLAG, rmsd);
+    free(classes);
+    free(hashes);
+    free(sorted);
+    return depth > 1 ? depth - 1 : 1;
 }
 
-// Comparator for compatibility with qsort
-int strcompar(const void *a, const void *b) { return strcmp(*(char **)a, *(char **)b); }
-
-// Returns 1 if two arrays contain the same string elements, otherwise returns 0
-int arrayIdentity(char **arr1, char **arr2, int arrlen)
+// Changes the options of a reference, its bonding trees are computed again if their depth changes
+// Must not be called while the reference is used by other threads, returns 0 on allocation failure
+int dock_rmsd_reference_set_options(DockRMSDReference *ref, const DockRMSDOptions *options)
 {
-    char **list1 = (char **)calloc(arrlen, sizeof(char *));
-    char **list2 = (char **)calloc(arrlen, sizeof(char *));
-    for (int i = 0; i < arrlen; i++)
+    int depth = options->depth > 0 ? options->depth : adaptiveDepth(&ref->mol);
+    ref->options = *options;
+    if (ref->trees && depth == ref->depth)
+    {
+        return 1;
+    }
+    int atomcount = ref->mol.atomcount;
+    uint64_t *trees = (uint64_t *)malloc(sizeof(uint64_t) * (2 * (size_t)depth * atomcount + 1));
+    if (!trees)
+    {
+        return 0;
+    }
+    free(ref->trees);
+    ref->trees = trees;
+    ref->depth = depth;
+    // Bonding trees are needed both with their bond types and with generalized bonds
+    for (int generalflag = 0; generalflag < 2; generalflag++)
     {
-        list1[i] = *(arr1 + i);
-        list2[i] = *(arr2 + i);
+        treeHashes(&ref->mol, 1, depth, generalflag, ref->trees + treeIndex(ref, generalflag, 1, 0));
     }
-    qsort(list1, arrlen, sizeof(list1[0]), strcompar);
-    qsort(list2, arrlen, sizeof(list2[0]), strcompar);
-    for (int i = 0; i < arrlen; i++)
+    // Atoms are told apart by their element and bonding trees, as candidates are
+    uint64_t *colors = (uint64_t *)malloc(sizeof(uint64_t) * (2 * atomcount + 1));
+    for (int generalflag = 0; generalflag < 2; generalflag++)
     {
-        if (strcmp(list1[i], list2[i]))
+        for (int i = 0; i < atomcount; i++)
         {
-            free(list1);
-            free(list2);
-            return 0;
+            uint64_t color = mixHash((uint64_t)ref->mol.elements[i]);
+            for (int treedepth = 1; treedepth <= depth; treedepth++)
+            {
+                color = mixHash(color ^ ref->trees[treeIndex(ref, generalflag, treedepth, i)]);
+            }
+            colors[generalflag * atomcount + i] = color;
+        }
+    }
+    ref->possiblemaps = 1.0;
+    for (int i = 0; i < atomcount; i++)
+    { // Such a pose has as many candidates for an atom as the reference has atoms of its class
+        int classsize = 0;
+        for (int j = 0; j < atomcount; j++)
+        {
+            classsize += colors[i] == colors[j];
+        }
+        ref->possiblemaps *= classsize;
+    }
+    freeSymmetry(&ref->symmetry[0]);
+    freeSymmetry(&ref->symmetry[1]);
+    if (!cachedSymmetry(&ref->mol, depth, ref->symmetry))
+    {
+        buildSymmetry(&ref->mol, colors, &ref->symmetry[0]);
+        if (samePartition(colors, colors + atomcount, atomcount))
+        { // Bond types tell apart no atom, the automorphisms are the same
+            copySymmetry(&ref->symmetry[1], &ref->symmetry[0], atomcount);
         }
+        else
+        {
+            buildSymmetry(&ref->mol, colors + atomcount, &ref->symmetry[1]);
+        }
+        cacheSymmetry(&ref->mol, depth, ref->symmetry);
     }
-    free(list1);
-    free(list2);
+    free(colors);
     return 1;
 }
 
-// Returns the index+1 if the element n is already in the array, otherwise returns 0
-int inArray(int n, int *arr, int arrlen)
+DockRMSDReference *dock_rmsd_reference(FILE *reference)
 {
-    int i;
-    for (i = 0; i < arrlen; i++)
+    Mol2Reader reader = fileReader(reference);
+    return prepareReference(&reader);
+}
+
+DockRMSDReference *dock_rmsd_reference_buffer(const char *data, size_t size)
+{
+    Mol2Reader reader = bufferReader(data, size);
+    return prepareReference(&reader);
+}
+
+// Returns the RMSD between the prepared reference (query) and the first molecule of a reader (template)
+DockRMSD scoreReader(const DockRMSDReference *ref, Mol2Reader *reader)
+{
+    Molecule temp;
+    readNextMolecule(reader, &temp, HFLAG);
+    DockRMSD rmsd = scorePose(ref, &temp, NULL, DBL_MAX);
+    freeMolecule(&temp);
+    return rmsd;
+}
+
+// Returns the RMSD between the prepared reference (query) and a pose (template) read from a mol2 file
+DockRMSD dock_rmsd_pose(const DockRMSDReference *ref, FILE *pose)
+{
+    Mol2Reader reader = fileReader(pose);
+    return scoreReader(ref, &reader);
+}
+
+// Returns the RMSD between the prepared reference (query) and a pose (template) held in memory
+DockRMSD dock_rmsd_pose_buffer(const DockRMSDReference *ref, const char *data, size_t size)
+{
+    Mol2Reader reader = bufferReader(data, size);
+    return scoreReader(ref, &reader);
+}
+
+void dock_rmsd_reference_free(DockRMSDReference *ref)
+{
+    if (!ref)
     {
-        if (*(arr + i) == n)
-        {
-            return i + 1;
-        }
+        return;
     }
-    return 0;
+    free(ref->trees);
+    freeSymmetry(&ref->symmetry[0]);
+    freeSymmetry(&ref->symmetry[1]);
+    free(ref->sortedatoms);
+    free(ref->sortedbonds);
+    freeMolecule(&ref->mol);
+    free(ref);
 }
 
-// Returns the count of atoms in a mol2 file
-int grabAtomCount(FILE *mol2, int hflag)
+// Fills classes with the symmetry class of every atom of the reference: the smallest atom an automorphism keeping
+// the bonding trees can exchange it with. Returns the number of classes, -1 if the automorphisms are unknown
+int dock_rmsd_reference_symmetry(const DockRMSDReference *ref, int *classes)
 {
-    char line[MAXLINELENGTH];
-    int atomcount = 0;
-    int countflag = 0;
-    while (fgets(line, MAXLINELENGTH, mol2) != NULL)
+    const Symmetry *symmetry = &ref->symmetry[0];
+    if (symmetry->levels < 0)
     {
-        if (strlen(line) > 1 && line[strlen(line) - 2] == '\r')
-        { // For windows line endings
-            line[strlen(line) - 2] = '\n';
-            line[strlen(line) - 1] = '\0';
-        }
-        if (!strcmp(line, "@<TRIPOS>ATOM\n"))
-        {
-            countflag = 1;
-            continue;
-        }
-        if (!strcmp(line, "@<TRIPOS>BOND\n"))
-        {
-            countflag = 0;
-            break;
-        }
-        if (countflag && strlen(line) > 1)
-        {
-            char *token = strtok(line, " \t");
-            int i;
-            for (i = 0; i < 5; i++)
-            {
-                token = strtok(NULL, " \t");
-            }
-            if (hflag || strcmp(token, "H"))
-            {
-                atomcount++;
-            }
-        }
+        return -1;
     }
-    if (ferror(mol2))
+    int count = 0;
+    for (int i = 0; i < ref->mol.atomcount; i++)
     {
-        fprintf(stderr, "Error %d while reading in file.\n", ferror(mol2));
+        classes[i] = symmetry->orbits[i];
+        count += classes[i] == i;
     }
-    rewind(mol2); // resets the file pointer for use in other functions
-    return atomcount;
+    return count;
 }
 
-// Fills atoms, coords, and bonds with information contained within a mol2 file
-void readMol2(char **atoms, double **coords, char ***bonds, int *nums, FILE *mol2, int atomcount, int hflag)
+#define ARENAHEADER ((sizeof(ArenaBlock) + 15) & ~(size_t)15) // Header size keeping the memory 16 bytes aligned
+
+// Returns size bytes aligned on 16 bytes from the arena, NULL if memory is exhausted
+void *arenaAlloc(Arena *arena, size_t size)
 {
-    int i = 0;
-    int sectionflag = 0; // Value is 1 when reading atoms, 2 when reading bonds, 0 before atoms, >2 after bonds
-    char line[MAXLINELENGTH];
-    int *atomnums = (int *)malloc(sizeof(int) * atomcount); // Keeps track of all non-H atom numbers for bond reading
-    while (fgets(line, MAXLINELENGTH, mol2) != NULL)
+    size = (size + 15) & ~(size_t)15;
+    ArenaBlock *block = arena->head;
+    if (!block || block->used + size > block->size)
     {
-        if (strlen(line) > 1 && line[strlen(line) - 2] == '\r')
-        { // Handling windows line endings
-            line[strlen(line) - 2] = '\n';
-            line[strlen(line) - 1] = '\0';
-        }
-        if (!strcmp(line, "@<TRIPOS>ATOM\n") || (sectionflag && line[0] == '@'))
+        size_t blocksize = block ? 2 * block->size : ARENABLOCK;
+        if (blocksize < size)
         {
-            sectionflag++;
-        }
-        else if (sectionflag == 1)
-        { // Reading in atoms and coordinates
-            double coord[3];
-            int j = 0;
-            char *parts = strtok(line, " \t");
-            int atomnum = atoi(parts);
-            parts = strtok(NULL, " \t");
-            for (j = 0; j < 3; j++)
-            {
-                parts = strtok(NULL, " \t");
-                coord[j] = atof(parts);
-            }
-            parts = strtok(NULL, " \t");
-            if (hflag || strcmp("H", parts))
-            {
-                char *element = strtok(parts, ".");
-                strcpy(*(atoms + i), element);
-                atomnums[i] = atomnum;
-                for (j = 0; j < 3; j++)
-                {
-                    *(*(coords + i) + j) = coord[j];
-                }
-                i++;
-            }
+            blocksize = size;
         }
-        else if (sectionflag == 2)
-        { // Reading in bonding network
-            char *parts = strtok(line, " \t");
-            parts = strtok(NULL, " \t");
-            int from = inArray(atoi(parts), atomnums, atomcount) - 1;
-            parts = strtok(NULL, " \t");
-            int to = inArray(atoi(parts), atomnums, atomcount) - 1;
-            parts = strtok(NULL, " \t");
-            parts = strtok(parts, "\n");
-            if (from >= 0 && to >= 0)
-            {
-                strcpy(*(*(bonds + to) + from), parts);
-                strcpy(*(*(bonds + from) + to), parts);
-            }
+        ArenaBlock *grown = (ArenaBlock *)malloc(ARENAHEADER + blocksize);
+        if (!grown)
+        {
+            return NULL;
         }
+        grown->next = block;
+        grown->size = blocksize;
+        grown->used = 0;
+        arena->head = block = grown;
     }
-    for (i = 0; i < atomcount; i++)
+    void *memory = (char *)block + ARENAHEADER + block->used;
+    block->used += size;
+    return memory;
+}
+
+void *arenaCalloc(Arena *arena, size_t count, size_t size)
+{
+    void *memory = arenaAlloc(arena, count * size);
+    if (memory)
     {
-        *(nums + i) = atomnums[i];
+        memset(memory, 0, count * size);
     }
-    free(atomnums);
+    return memory;
 }
 
-// Changes all bond types to generic "b" if the bond types don't agree between query and template. Returns true if this has already been done, false if not.
-int generalizeBonds(char ***bonds, int atomcount)
+void arenaFree(Arena *arena)
 {
-    int i;
-    int j;
-    for (i = 0; i < atomcount; i++)
+    while (arena->head)
     {
-        for (j = 0; j < atomcount; j++)
-        {
-            if (strcmp(*(*(bonds + i) + j), ""))
-            {
-                if (!strcmp(*(*(bonds + i) + j), "b"))
-                {
-                    return 1;
-                }
-                strcpy(*(*(bonds + i) + j), "b");
-            }
-        }
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-    return 0;
 }
 
-// Recursive function that returns a pointer array of leaves in the bonding tree at a specified depth
-char **buildTree(int depth, int index,
-                 char **atoms, char ***bonds,
-                 char *prestring, int prevind, int atomcount)
+// Replaces the error of a result, owned errors were allocated for it and are freed by dock_rmsd_free
+void setError(DockRMSD *rmsd, char *error, int owned)
 {
-    // int n;
-    if (depth == 0)
-    { // Base case, if max depth is reached return the prestring
-        char **outp = (char **)malloc(sizeof(char *) * 2);
-        char *outstring = (char *)malloc(sizeof(char) * (strlen(prestring) + 1));
-        strcpy(outstring, prestring);
-        *outp = outstring;
-        *(outp + 1) = NULL;
-        return outp;
+    if (rmsd->_errorowned)
+    {
+        free(rmsd->error);
     }
-    else
+    rmsd->error = error;
+    rmsd->_errorowned = owned;
+}
+
+// Releases what a result owns: its mapping and its text, and its error when it was formatted for it
+void dock_rmsd_free(DockRMSD *rmsd)
+{
+    if (rmsd->optimal_mapping && *rmsd->optimal_mapping)
     {
-        // Grab all immediate neighbors of the current atom
-        int bondinds[MAXBONDS];
-        char *bondtypes[MAXBONDS];
-        int i;
-        int bondi = 0;
-        for (i = 0; i < atomcount; i++)
-        {
-            if (strcmp(*(*(bonds + index) + i), ""))
-            {
-                bondinds[bondi] = i;
-                bondtypes[bondi] = *(*(bonds + index) + i);
-                bondi++;
-            }
-        }
-        int maxleaves = (int)pow((double)MAXBONDS, (double)depth); // Maximum possible number of leaf nodes at this depth
-        char **outlist = (char **)malloc(sizeof(char *) * (maxleaves + 1));
-        if (!outlist)
-        { // If the outlist pointer wasn't mallocated, you've hit the recursion limit
-            return NULL;
-        }
-        *outlist = NULL;
-        int leafind = 0;
-        for (i = 0; i < bondi; i++)
-        {
-            if (bondinds[i] != prevind)
-            { // Don't analyze the atom we just came from in the parent function call
-                // char newpre[strlen(prestring) + 8];
-                char *newpre = (char *)malloc(strlen(prestring) + 8);
-                strcpy(newpre, prestring);
-                strcat(newpre, bondtypes[i]);
-                strcat(newpre, *(atoms + bondinds[i]));
-                // Recurse and fetch all leaves of the binding tree for this neighbor
-                char **new = buildTree(depth - 1, bondinds[i], atoms, bonds, newpre, index, atomcount);
-                free(newpre);
-                char **newit = new;
-                while (*newit)
-                { // Append the new leaves onto outlist
-                    *(outlist + leafind) = *newit;
-                    newit++;
-                    leafind++;
-                }
-                free(new);
-                *(outlist + leafind) = NULL;
-            }
-        }
-        if (!*outlist)
-        { // Another base case, if the current atom's only neighbor is the atom analyzed in the parent function call
-            free(outlist);
-            outlist = malloc(sizeof(char *) * 2);
-            *outlist = malloc(sizeof(char) * (strlen(prestring) + 1));
-            strcpy(*outlist, prestring);
-            *(outlist + 1) = NULL;
-        }
-        return outlist;
+        free(rmsd->optimal_mapping);
     }
+    rmsd->optimal_mapping = "";
+    free(rmsd->mapping);
+    rmsd->mapping = NULL;
+    setError(rmsd, "", 0);
 }
 
-double searchAssigns(int atomcount, int **allcands,
-                     int candcounts[], int *assign,
-                     char ***tempbond, char ***querybond,
-                     double **querycoord, double **tempcoord, int *bestassign)
+// Checks that the pose has the same atoms and bonding network as the reference, then searches for the optimal mapping
+// temptrees are the bonding trees of a pose prepared as a reference at the same depth, NULL to compute them
+// A pose whose RMSD is above bound is abandoned without mapping, DBL_MAX for none; the assignment ignoring bonds and
+// the automorphism search are exact anyway
+DockRMSD scorePose(const DockRMSDReference *ref, Molecule *temp, const uint64_t *temptrees, double bound)
 {
-    double **dists = (double **)malloc(sizeof(double *) * atomcount); // Distances between query atoms and template atoms
-    double *querydists = (double *)malloc(sizeof(double) * atomcount * atomcount);
-    int **queryconnect = (int **)malloc(atomcount * sizeof(int *));
-    for (int i = 0; i < atomcount; i++)
+    int querycount = ref->mol.atomcount;
+    int tempcount = temp->atomcount;
+    DockRMSD rmsd = {0, 0, "", "", querycount, tempcount, 0, 0, 0, NULL, 0, 0, 0};
+
+    if (querycount != tempcount)
+    {
+        rmsd.error = "Error: Query and template don't have the same atom count!";
+        return rmsd;
+    }
+    if (querycount == 0)
+    {
+        rmsd.error = "Error: Query file has no atoms!";
+        return rmsd;
+    }
+    if (tempcount == 0)
+    {
+        rmsd.error = "Error: Template file has no atoms!";
+        return rmsd;
+    }
+    int *sortedtempatoms = sortedCopy(temp->elements, tempcount);
+    int sameatoms = !memcmp(ref->sortedatoms, sortedtempatoms, sizeof(int) * querycount);
+    free(sortedtempatoms);
+    if (!sameatoms)
+    {
+        rmsd.error = "Template and query don't have the same atoms.";
+        return rmsd;
+    }
+    Arena arena = {NULL}; // Scratch memory of the mapping search
+    if (ref->options.hungarian)
     {
-        queryconnect[i] = (int *)malloc(MAXBONDS * sizeof(int *));
+        rmsd = hungarianAssign(ref, temp, rmsd, &arena);
+        arenaFree(&arena);
+        rmsd.within_threshold = ref->options.threshold > 0 && rmsd.mapping && rmsd.rmsd <= ref->options.threshold;
+        return rmsd;
     }
 
-    int *bondcount = (int *)malloc(sizeof(int) * atomcount);
-    int *connectcount = (int *)malloc(sizeof(int) * atomcount);
-    // precalculate all query-template atomic distances
-    for (int i = 0; i < atomcount; i++)
+    int generalflag = 0;
+    int tempbondcount;
+    int *sortedtempbonds = sortedBonds(temp, &tempbondcount);
+    if (tempbondcount != ref->bondcount || memcmp(ref->sortedbonds, sortedtempbonds, sizeof(int) * tempbondcount))
     {
-        *(assign + i) = -1;
-        connectcount[i] = 0;
-        double *distind = (double *)malloc(sizeof(double) * candcounts[i]);
-        for (int j = 0; j < candcounts[i]; j++)
+        // Remove bond typing if they don't agree between query and template
+        generalflag = 1;
+        // If the general bonds still don't agree, the molecules aren't the same
+        if (tempbondcount != ref->bondcount)
         {
-            double dist = 0.0;
-            for (int index = 0; index < 3; index++)
-            {
-                dist += pow(*(*(querycoord + i) + index) - *(*(tempcoord + *(*(allcands + i) + j)) + index), 2.0);
-            }
-            *(distind + j) = dist;
+            free(sortedtempbonds);
+            rmsd.error = "Template and query don't have the same bonding network.";
+            return rmsd;
         }
-        *(dists + i) = distind;
     }
-    memcpy(bestassign, assign, sizeof(int) * atomcount);
+    free(sortedtempbonds);
+    if (!generalflag && ref->symmetry[0].levels >= 0 && sameNumbering(&ref->mol, temp))
+    {
+        rmsd = symmetryAssign(ref, temp, rmsd, &arena);
+    }
+    else
+    {
+        rmsd = assignAtoms(ref, temp, temptrees, bound, generalflag, SIMPLEFLAG, rmsd, &arena);
+    }
+    arenaFree(&arena);
+    rmsd.within_threshold = ref->options.threshold > 0 && rmsd.mapping && rmsd.rmsd <= ref->options.threshold;
+    return rmsd;
+}
 
-    // precalculate all query-query atomic distances for feasibility check
-    for (int i = 0; i < atomcount; i++)
+// Returns the index+1 if the element n is already in the array, otherwise returns 0
+int inArray(int n, int *arr, int arrlen)
+{
+    int i;
+    for (i = 0; i < arrlen; i++)
     {
-        for (int j = i; j < atomcount; j++)
+        if (*(arr + i) == n)
         {
-            double dist = 0.0;
-            for (int index = 0; index < 3; index++)
-                dist += pow(*(*(querycoord + i) + index) - *(*(querycoord + j) + index), 2.0);
-            querydists[i * atomcount + j] = pow(dist, 0.5);
-            querydists[j * atomcount + i] = querydists[i * atomcount + j];
+            return i + 1;
         }
     }
-    free(querydists);
+    return 0;
+}
 
-    // Calculate bond degree for every atom
-    for (int i = 0; i < atomcount; i++)
+// Returns the code of an element symbol: its atomic number, other symbols keep their first two characters packed above
+int elementCode(const char *symbol)
+{
+    char name[3];
+    snprintf(name, 3, "%s", symbol);
+    for (int code = 1; code < ELEMENTNAMES; code++)
     {
-        int degree = 0;
-        for (int j = 0; j < atomcount; j++)
+        if (!strcmp(name, elementnames[code]))
         {
-            if (strcmp(*(*(querybond + i) + j), ""))
-            {
-                queryconnect[i][degree] = j;
-                degree++;
-            }
+            return code;
         }
-        bondcount[i] = degree;
     }
-    // bubble sort all possible atoms at each position by query-template distance
-    for (int index = 0; index < atomcount; index++)
-    {
-        for (int i = 0; i < candcounts[index]; i++)
+    return ELEMENTNAMES + (((unsigned char)name[0] << 8) | (unsigned char)name[1]);
+}
+
+// Writes the symbol of an element code into name, which holds 3 characters
+void elementName(int code, char *name)
+{
+    if (code < ELEMENTNAMES)
+    {
+        strcpy(name, elementnames[code]);
+        return;
+    }
+    code -= ELEMENTNAMES;
+    name[0] = (char)(code >> 8);
+    name[1] = (char)(code & 0xff);
+    name[2] = '\0';
+}
+
+// Returns the code of a mol2 bond type, other types keep their first two characters packed above the known ones
+int bondCode(const char *type)
+{
+    char name[3];
+    snprintf(name, 3, "%s", type);
+    for (int code = 1; code < BONDNAMES; code++)
+    {
+        if (!strcmp(name, bondnames[code]))
         {
-            for (int j = 0; j < candcounts[index] - i - 1; j++)
-            {
-                if (*(*(dists + index) + j) > *(*(dists + index) + j + 1))
-                {
-                    int tempind = *(*(allcands + index) + j);
-                    double tempdist = *(*(dists + index) + j);
-                    *(*(allcands + index) + j) = *(*(allcands + index) + j + 1);
-                    *(*(dists + index) + j) = *(*(dists + index) + j + 1);
-                    *(*(allcands + index) + j + 1) = tempind;
-                    *(*(dists + index) + j + 1) = tempdist;
-                }
-            }
+            return code;
         }
     }
-    int *history = (int *)malloc(sizeof(int) * atomcount);
-    int *histinds = (int *)malloc(sizeof(int) * atomcount);
-    for (int i = 0; i < atomcount; i++)
+    return BONDNAMES + (((unsigned char)name[0] << 8) | (unsigned char)name[1]);
+}
+
+// Returns the position of atom to in the adjacency list of atom from, or -1 if they aren't bonded
+int findBond(const Molecule *mol, int from, int to)
+{
+    for (int i = mol->bondstarts[from]; i < mol->bondstarts[from + 1]; i++)
     {
-        histinds[i] = 0;
+        if (mol->neighbors[i] == to)
+        {
+            return i;
+        }
     }
+    return -1;
+}
 
-    double runningTotal = 0.0;
-    double bestTotal = DBL_MAX;
-    int index = 0;
-    while (1)
-    { // While not all mappings have been searched
-        if (index == atomcount)
-        { // If we've reached the end of a mapping and haven't been pruned
-            if (runningTotal < bestTotal)
-            {
-                memcpy(bestassign, assign, sizeof(int) * atomcount);
-                bestTotal = runningTotal;
-            }
-            index--;
-            runningTotal -= *(*(dists + history[index]) + histinds[index] - 1);
-            continue;
+// Replaces atom numbers by the index of the first atom with that number, -1 for removed or missing atoms
+// Numbers are looked up in a table indexed by number, files with sparse numbers keep the linear search
+void atomIndices(const Molecule *mol, int *nums, int count)
+{
+    int atomcount = mol->atomcount;
+    int minnum = 0;
+    int maxnum = -1;
+    for (int i = 0; i < atomcount; i++)
+    {
+        if (!i || mol->nums[i] < minnum)
+            minnum = mol->nums[i];
+        if (!i || mol->nums[i] > maxnum)
+            maxnum = mol->nums[i];
+    }
+    long long range = (long long)maxnum - minnum + 1;
+    if (range > 4LL * atomcount + 64)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            nums[i] = inArray(nums[i], mol->nums, atomcount) - 1;
         }
-        if (histinds[index])
-        { // Atom to analyze has been picked, we need to change the mapping
+        return;
+    }
+    int *table = (int *)malloc(sizeof(int) * (range + 1));
+    for (int i = 0; i < range; i++)
+    {
+        table[i] = -1;
+    }
+    for (int i = atomcount - 1; i >= 0; i--)
+    {
+        table[mol->nums[i] - minnum] = i;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        nums[i] = nums[i] >= minnum && nums[i] <= maxnum ? table[nums[i] - minnum] : -1;
+    }
+    free(table);
+}
 
-            while (index > 0 && histinds[index] == candcounts[history[index]])
-            {
-                histinds[index] = 0;
-                *(assign + history[index]) = -1;
-                for (int i = 0; i < bondcount[history[index]]; i++)
-                {
-                    connectcount[queryconnect[history[index]][i]]--;
-                }
-                index--;
-                runningTotal -= *(*(dists + history[index]) + histinds[index] - 1);
-            }
-            if (index == 0 && histinds[0] == candcounts[history[0]])
-            { // This occurs when all mappings have been exhausted
-                break;
-            }
+// Builds the adjacency lists of a molecule from its bonds, given as atom indices
+// A bond listed twice keeps its last type, like a bond matrix would
+void buildBonds(Molecule *mol, const int *bondends, const int *bondtypes, int bondcount)
+{
+    int atomcount = mol->atomcount;
+    mol->bondstarts = (int *)calloc(atomcount + 1, sizeof(int));
+    for (int i = 0; i < 2 * bondcount; i++)
+    {
+        if (bondends[i] >= 0)
+        {
+            mol->bondstarts[bondends[i] + 1]++;
         }
-        else
-        { // Pick an atom to analyze
-            int nextAtom = 0;
-            double bestMetric = DBL_MAX;
-            for (int i = 0; i < atomcount; i++)
+    }
+    for (int i = 0; i < atomcount; i++)
+    {
+        mol->bondstarts[i + 1] += mol->bondstarts[i];
+    }
+    mol->neighbors = (int *)malloc(sizeof(int) * (mol->bondstarts[atomcount] + 1));
+    mol->bondtypes = (int *)malloc(sizeof(int) * (mol->bondstarts[atomcount] + 1));
+    int *degrees = (int *)calloc(atomcount + 1, sizeof(int));
+    for (int i = 0; i < bondcount; i++)
+    {
+        int from = bondends[2 * i];
+        int to = bondends[2 * i + 1];
+        if (from < 0 || to < 0)
+        {
+            continue;
+        }
+        for (int end = 0; end < 2; end++)
+        {
+            int atom = end ? to : from;
+            int other = end ? from : to;
+            int *list = mol->neighbors + mol->bondstarts[atom];
+            int j = 0;
+            while (j < degrees[atom] && list[j] != other)
             {
-                double nodescore = -0.1 * ((double)connectcount[i]) + 1.0 * ((double)candcounts[i]);
-                if (nodescore < bestMetric && *(assign + i) == -1)
-                {
-                    nextAtom = i;
-                    bestMetric = nodescore;
-                }
+                j++;
             }
-            history[index] = nextAtom;
-            for (int i = 0; i < bondcount[history[index]]; i++)
+            if (j == degrees[atom])
             {
-                connectcount[queryconnect[history[index]][i]]++;
+                degrees[atom]++;
             }
+            list[j] = other;
+            mol->bondtypes[mol->bondstarts[atom] + j] = bondtypes[i];
         }
-        int foundflag = 0;
-        for (int i = histinds[index]; i < candcounts[history[index]]; i++)
-        {
+    }
+    // Compact the lists, duplicated bonds have left holes at their end
+    int count = 0;
+    for (int i = 0; i < atomcount; i++)
+    {
+        int start = mol->bondstarts[i];
+        mol->bondstarts[i] = count;
+        memmove(mol->neighbors + count, mol->neighbors + start, sizeof(int) * degrees[i]);
+        memmove(mol->bondtypes + count, mol->bondtypes + start, sizeof(int) * degrees[i]);
+        count += degrees[i];
+    }
+    mol->bondstarts[atomcount] = count;
+    free(degrees);
+}
 
-            if (runningTotal + *(*(dists + history[index]) + i) > bestTotal)
-            { // Dead end elimination check
-                break;
-            }
+// Grows the per atom arrays of a molecule to capacity atoms
+void reserveAtoms(Molecule *mol, int capacity)
+{
+    mol->elements = (int *)realloc(mol->elements, capacity * sizeof(int));
+    mol->x = (double *)realloc(mol->x, capacity * sizeof(double));
+    mol->y = (double *)realloc(mol->y, capacity * sizeof(double));
+    mol->z = (double *)realloc(mol->z, capacity * sizeof(double));
+    mol->nums = (int *)realloc(mol->nums, capacity * sizeof(int));
+}
 
-            if (!inArray(*(*(allcands + history[index]) + i), assign, atomcount) && validateBonds(assign, *(*(allcands + history[index]) + i), history[index], querybond, tempbond, atomcount))
-            { // Feasibility check
-                foundflag = 1;
-                *(assign + history[index]) = *(*(allcands + history[index]) + i);
-                histinds[index] = i + 1;
-                runningTotal += *(*(dists + history[index]) + i);
-                index++;
-                break;
-            }
+// Returns a reader over a mol2 file
+Mol2Reader fileReader(FILE *mol2)
+{
+    Mol2Reader reader;
+    memset(&reader, 0, sizeof(Mol2Reader));
+    reader.mol2 = mol2;
+    return reader;
+}
+
+// Returns a reader over a mol2 file held in memory, the buffer is read in place and must outlive the reader
+Mol2Reader bufferReader(const char *data, size_t size)
+{
+    Mol2Reader reader;
+    memset(&reader, 0, sizeof(Mol2Reader));
+    reader.data = data;
+    reader.size = size;
+    return reader;
+}
+
+// Maps a whole mol2 file in memory for the *_buffer functions, returns 0 on failure
+int dock_rmsd_map(const char *path, Mol2Map *map)
+{
+    memset(map, 0, sizeof(Mol2Map));
+    map->data = "";
+#ifdef _WIN32
+    map->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (map->file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(map->file, &size))
+    {
+        CloseHandle(map->file);
+        return 0;
+    }
+    map->size = (size_t)size.QuadPart;
+    if (map->size)
+    {
+        map->mapping = CreateFileMappingA(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        const char *data = map->mapping ? (const char *)MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (!data)
+        {
+            if (map->mapping)
+                CloseHandle(map->mapping);
+            CloseHandle(map->file);
+            return 0;
         }
-        if (!foundflag)
-        { // This occurs if none of the remaining possibilities can be mapped
-            if (index == 0)
-            {
-                break;
-            }
-            else
-            {
-                histinds[index] = 0;
-                *(assign + history[index]) = -1;
-                for (int i = 0; i < bondcount[history[index]]; i++)
-                {
-                    connectcount[queryconnect[history[index]][i]]--;
-                }
-                index--;
-                runningTotal -= *(*(dists + history[index]) + histinds[index] - 1);
-            }
+        map->data = data;
+    }
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat status;
+    if (fstat(fd, &status) < 0)
+    {
+        close(fd);
+        return 0;
+    }
+    map->size = (size_t)status.st_size;
+    if (map->size)
+    {
+        void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return 0;
         }
+        map->data = (const char *)data;
     }
-    free(histinds);
-    free(history);
-    free(bondcount);
-    free(connectcount);
-    for (int i = 0; i < atomcount; i++)
+    close(fd); // The mapping stays valid once the descriptor is closed
+#endif
+    return 1;
+}
+
+void dock_rmsd_unmap(Mol2Map *map)
+{
+    if (!map->size)
     {
-        free(*(dists + i));
+        return;
     }
-    free(dists);
-    for (int i = 0; i < atomcount; i++)
-        free(queryconnect[i]);
-    free(queryconnect);
-    if (*bestassign != -1)
+#ifdef _WIN32
+    UnmapViewOfFile(map->data);
+    CloseHandle(map->mapping);
+    CloseHandle(map->file);
+#else
+    munmap((void *)map->data, map->size);
+#endif
+    map->data = "";
+    map->size = 0;
+}
+
+// Returns the next token of a line split on blanks and moves the cursor past it, NULL when the line is exhausted
+// Tokens are terminated in place; the cursor is owned by the caller so that, unlike strtok, parsing is reentrant
+char *nextToken(char **cursor)
+{
+    char *it = *cursor;
+    while (*it == ' ' || *it == '\t')
     {
-        return pow(bestTotal / ((double)atomcount), 0.5);
+        it++;
     }
-    else
+    if (!*it)
     {
-        return DBL_MAX;
+        *cursor = it;
+        return NULL;
+    }
+    char *token = it;
+    while (*it && *it != ' ' && *it != '\t')
+    {
+        it++;
+    }
+    if (*it)
+    {
+        *it++ = '\0';
     }
+    *cursor = it;
+    return token;
 }
 
-// Checks if the assignment of the current atom is feasible
-int validateBonds(int *atomassign, int proposedatom,
-                  int assignpos, char ***querybond,
-                  char ***tempbond, int atomcount)
+// Splits an atom line of a mol2 file, returns 0 if the line is not a valid atom record
+int parseAtomLine(char *line, int *atomnum, double *coord, char **type)
 {
-    int queri = 0;
-    int queryinds[MAXBONDS];
-    for (int j = 0; j < atomcount; j++)
+    char *parts = nextToken(&line);
+    if (!parts)
     {
-        if (strcmp(*(*(querybond + assignpos) + j), ""))
-        {
-            queryinds[queri] = j;
-            queri++;
-        }
+        return 0;
     }
-    for (int j = 0; j < queri; j++)
+    *atomnum = atoi(parts);
+    nextToken(&line); // Atom name
+    for (int j = 0; j < 3; j++)
     {
-        int assignatom = *(atomassign + queryinds[j]);
-        if (assignatom >= 0 && !strcmp(*(*(tempbond + proposedatom) + assignatom), ""))
+        parts = nextToken(&line);
+        if (!parts)
         {
             return 0;
         }
+        coord[j] = atof(parts);
     }
+    *type = nextToken(&line);
+    return *type != NULL;
+}
 
-    return 1;
+// Splits a bond line of a mol2 file, returns 0 if the line is not a valid bond record
+int parseBondLine(char *line, int *from, int *to, char **type)
+{
+    nextToken(&line); // Bond id
+    char *parts = nextToken(&line);
+    if (!parts)
+    {
+        return 0;
+    }
+    *from = atoi(parts);
+    parts = nextToken(&line);
+    if (!parts)
+    {
+        return 0;
+    }
+    *to = atoi(parts);
+    *type = nextToken(&line);
+    return *type != NULL;
 }
 
-// Returns the lowest RMSD of all possible mappings for query atoms with template indices given the two molecules' bonding network
-DockRMSD assignAtoms(char **tempatom, char ***tempbond,
-                     char **queryatom, char ***querybond,
-                     double **querycoord, double **tempcoord,
-                     int *querynums, int *tempnums,
-                     int atomcount, int simpleflag,
-                     DockRMSD rmsd)
-{
-    int **allcands = (int **)malloc(sizeof(int *) * atomcount); // List of all atoms in the template that could feasibly be each query atom
-    int *candcounts = (int *)malloc(atomcount * sizeof(int)); // Number of atoms in the template that could feasibly be each query atom
-    // Iterate through each query atom and determine which template atoms correspond to the query
-    for (int i = 0; i < atomcount; i++)
+// Reads one line into the reader without its line ending, returns its length or -1 at the end of the file
+int readLine(Mol2Reader *reader)
+{
+    char *line = reader->line;
+    int len;
+    if (!reader->mol2)
+    { // Copy the line out of the buffer, truncated like fgets would
+        if (reader->offset >= reader->size)
+        {
+            return -1;
+        }
+        const char *start = reader->data + reader->offset;
+        const char *end = (const char *)memchr(start, '\n', reader->size - reader->offset);
+        size_t linelen = end ? (size_t)(end - start) : reader->size - reader->offset;
+        reader->offset += end ? linelen + 1 : linelen;
+        len = linelen < MAXLINELENGTH - 1 ? (int)linelen : MAXLINELENGTH - 1;
+        memcpy(line, start, len);
+        line[len] = '\0';
+        while (len && line[len - 1] == '\r')
+        { // Handling windows line endings
+            line[--len] = '\0';
+        }
+        return len;
+    }
+    if (fgets(line, MAXLINELENGTH, reader->mol2) == NULL)
     {
-        int *candidates = (int *)malloc(atomcount * sizeof(int)); // Flags corresponding to if each template atom could correspond to the current query atom
-        int viablecands = 0;                                      // Count of template atoms that could correspond to the current query atom
-        for (int j = 0; j < atomcount; j++)
+        return -1;
+    }
+    len = (int)strlen(line);
+    if (len && line[len - 1] != '\n' && !feof(reader->mol2))
+    { // Drop the remainder of a line longer than the buffer
+        int c;
+        while ((c = fgetc(reader->mol2)) != EOF && c != '\n')
+            ;
+    }
+    while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    { // Handling unix and windows line endings
+        line[--len] = '\0';
+    }
+    return len;
+}
+
+// Reads the next @<TRIPOS>MOLECULE block of a mol2 file in a single pass, returns 0 when the file is exhausted
+// A file is never read twice: the header of the following block is kept in the reader for the next call
+// Per atom arrays are sized from the atom count of the molecule header and grown if the header is wrong
+int readNextMolecule(Mol2Reader *reader, Molecule *mol, int hflag)
+{
+    int sectionflag = 0; // Value is 1 when reading atoms, 2 when reading bonds, 0 before atoms, 3 in other sections
+    int started = 0;     // Becomes 1 once the header or the first section of the molecule has been read
+    int headerline = 0;  // Position of the current line after the @<TRIPOS>MOLECULE line, the counts are on line 2
+    int capacity = 0;
+    int bondcapacity = 0;
+    int bondcount = 0;
+    int *bondends = NULL; // Atom numbers of both ends of every bond
+    int *bondtypes = NULL;
+    memset(mol, 0, sizeof(Molecule));
+    int len = 0;
+    while (reader->pending || (len = readLine(reader)) >= 0)
+    {
+        char *line = reader->line;
+        if (reader->pending)
         {
-            if (!strcmp(*(queryatom + i), *(tempatom + j)))
-            {
-                candidates[j] = 1;
-                viablecands++;
-            }
-            else
-            {
-                candidates[j] = 0;
-            }
+            len = (int)strlen(line);
+            reader->pending = 0;
         }
-        int treedepth = 1; // Recursion depth
-        while (treedepth <= MAXDEPTH)
-        { // Recurse deeper until you've searched all atoms or you've hit the recursion limit
-            char **qtree = buildTree(treedepth, i, queryatom, querybond, *(queryatom + i), -1, atomcount);
-            if (!qtree)
-            { // This means you've hit the recursion limit and can't analyze any deeper
+        if (!strcmp(line, "@<TRIPOS>MOLECULE"))
+        {
+            if (started)
+            { // Keep the header for the next call
+                reader->pending = 1;
                 break;
             }
-            char **qit = qtree;
-            int qlen = 0;
-            while (*qit)
+            started = 1;
+            headerline = 1;
+            continue;
+        }
+        if (line[0] == '@')
+        {
+            started = 1;
+            headerline = 0;
+            sectionflag = !strcmp(line, "@<TRIPOS>ATOM") ? 1 : !strcmp(line, "@<TRIPOS>BOND") ? 2 : 3;
+            continue;
+        }
+        if (headerline)
+        {
+            if (headerline == 2 && atoi(line) > capacity)
             {
-                qlen++;
-                qit++;
+                reserveAtoms(mol, atoi(line));
+                capacity = atoi(line);
             }
-            for (int j = 0; j < atomcount; j++)
+            headerline = headerline == 2 ? 0 : 2;
+            continue;
+        }
+        if (!len)
+        {
+            continue;
+        }
+        if (sectionflag == 1)
+        { // Reading in atoms and coordinates
+            int atomnum;
+            double coord[3];
+            char *type;
+            if (!parseAtomLine(line, &atomnum, coord, &type) || (!hflag && !strcmp("H", type)))
             {
-                if (candidates[j])
-                {
-                    char **ttree = buildTree(treedepth, j, tempatom, tempbond, *(tempatom + j), -1, atomcount);
-                    char **tit = ttree;
-                    int tlen = 0;
-                    while (*tit)
-                    {
-                        tlen++;
-                        tit++;
-                    }
-                    if (tlen != qlen || !arrayIdentity(qtree, ttree, qlen))
-                    { // If the template atom tree and query atom tree don't have the same leaves, they're not the same atom
-                        candidates[j] = 0;
-                        viablecands--;
-                    }
-                    tit = ttree;
-                    while (*tit)
-                    {
-                        free(*tit);
-                        tit++;
-                    }
-                    free(ttree);
-                }
+                continue;
             }
-            qit = qtree;
-            while (*qit)
+            char *element = type;
+            char *subtype = strchr(type, '.');
+            if (subtype)
             {
-                free(*qit);
-                qit++;
+                *subtype = '\0';
             }
-            free(qtree);
-            treedepth++;
-        }
-        if (!viablecands)
-        { // If there's no possible atom, something went wrong or the two molecules are not identical
-            if (!generalizeBonds(querybond, atomcount))
+            if (!*element)
             {
-                if (!simpleflag)
-                {
-                    char *formatstring = NULL;
-                    if (0 > asprintf(&formatstring, "No atoms mappable for atom %d, generalizing bonds...\n", i))
-                        return rmsd;
-                    rmsd.error = formatstring;
-                }
-                generalizeBonds(tempbond, atomcount);
-                for (int j = 0; j < i; j++)
-                {
-                    free(*(allcands + j));
-                    candcounts[j] = 0;
-                }
-                i = -1;
                 continue;
             }
-            else
+            if (mol->atomcount == capacity)
             {
-                char *formatstring = NULL;
-                if (0 > asprintf(&formatstring, "Atom assignment failed for atom %d.\n", i))
-                    return rmsd;
-                rmsd.error = formatstring;
-                return rmsd;
+                reserveAtoms(mol, capacity ? 2 * capacity : 64);
+                capacity = capacity ? 2 * capacity : 64;
             }
+            mol->elements[mol->atomcount] = elementCode(element);
+            mol->x[mol->atomcount] = coord[0];
+            mol->y[mol->atomcount] = coord[1];
+            mol->z[mol->atomcount] = coord[2];
+            mol->nums[mol->atomcount] = atomnum;
+            mol->atomcount++;
         }
-        else
-        { // Otherwise, store all possible template atoms for this query atom
-            candcounts[i] = viablecands;
-            int *atomcands = malloc(sizeof(int) * viablecands);
-            int k = 0;
-            for (int j = 0; j < atomcount; j++)
+        else if (sectionflag == 2)
+        { // Reading in bonding network, resolved once all atoms are known
+            int from;
+            int to;
+            char *type;
+            if (!parseBondLine(line, &from, &to, &type))
             {
-                if (candidates[j])
-                {
-                    *(atomcands + k) = j;
-                    k++;
-                    if (k == viablecands)
-                    {
-                        break;
-                    }
-                }
+                continue;
             }
-            *(allcands + i) = atomcands;
+            if (bondcount == bondcapacity)
+            {
+                bondcapacity = bondcapacity ? 2 * bondcapacity : 64;
+                bondends = (int *)realloc(bondends, 2 * bondcapacity * sizeof(int));
+                bondtypes = (int *)realloc(bondtypes, bondcapacity * sizeof(int));
+            }
+            bondends[2 * bondcount] = from;
+            bondends[2 * bondcount + 1] = to;
+            bondtypes[bondcount] = bondCode(type);
+            bondcount++;
         }
-        free(candidates);
     }
+    atomIndices(mol, bondends, 2 * bondcount);
+    buildBonds(mol, bondends, bondtypes, bondcount);
+    free(bondends);
+    free(bondtypes);
+    return started;
+}
 
-    double possiblemaps = 1.0;
-    for (int i = 0; i < atomcount; i++)
-        possiblemaps *= candcounts[i];
-
-    // Calculate RMSD of all possible mappings given each query atoms possible template atoms and return the minimum
-    int *assign = (int *)malloc(atomcount * sizeof(int));
-    int *bestassign = (int *)malloc(atomcount * sizeof(int));
-    double bestrmsd = searchAssigns(atomcount, allcands, candcounts, assign, tempbond, querybond, querycoord, tempcoord, bestassign);
-    char *header = "Optimal mapping (First file -> Second file, * indicates correspondence is not one-to-one):\n";
-    char *optimal_mapping = (char *)calloc(strlen(header) + 1, sizeof(char));
-    char *formatstring = NULL;
-    strcpy(optimal_mapping, header);
-    rmsd.rmsd = bestrmsd;
-    rmsd.total_of_possible_mappings = possiblemaps;
-    if (bestrmsd == DBL_MAX)
+// Opens a stream over all the molecules of a multi-molecule mol2 file
+Mol2Reader *dock_rmsd_stream(FILE *poses)
+{
+    Mol2Reader *reader = (Mol2Reader *)malloc(sizeof(Mol2Reader));
+    if (reader)
     {
-        rmsd.error = "No valid mapping exists\n";
-        return rmsd;
+        *reader = fileReader(poses);
     }
-    for (int i = 0; i < atomcount; i++)
+    return reader;
+}
+
+// Opens a stream over all the molecules of a multi-molecule mol2 buffer, which must outlive the stream
+Mol2Reader *dock_rmsd_stream_buffer(const char *data, size_t size)
+{
+    Mol2Reader *reader = (Mol2Reader *)malloc(sizeof(Mol2Reader));
+    if (reader)
     {
-        if (0 > asprintf(&formatstring, "%s%3d -> %s%3d ", *(queryatom + i), *(querynums + i), *(tempatom + *(bestassign + i)), *(tempnums + *(bestassign + i))))
-            return rmsd;
-        optimal_mapping = (char *)realloc(optimal_mapping, strlen(optimal_mapping) + strlen(formatstring) + 1);
-        strcat(optimal_mapping, formatstring);
-        free(formatstring);
-        if (*(querynums + i) == *(tempnums + *(bestassign + i)))
-        {
-            optimal_mapping = (char *)realloc(optimal_mapping, strlen(optimal_mapping) + 2);
-            strcat(optimal_mapping, "\n");
-        }
-        else
-        {
-            optimal_mapping = (char *)realloc(optimal_mapping, strlen(optimal_mapping) + 3);
-            strcat(optimal_mapping, "*\n");
-        }
+        *reader = bufferReader(data, size);
     }
-    for (int i = 0; i < rmsd._querycount; i++)
+    return reader;
+}
+
+// Reads the next pose of the stream and compares it against the reference, returns 0 when no pose is left
+int dock_rmsd_stream_next(const DockRMSDReference *ref, Mol2Reader *reader, DockRMSD *rmsd)
+{
+    Molecule temp;
+    if (!readNextMolecule(reader, &temp, HFLAG))
     {
-        free(queryatom[i]);
-        free(tempatom[i]);
-        free(querycoord[i]);
-        for (int j = 0; j < rmsd._querycount; j++)
-        {
-            free(querybond[i][j]);
-            free(tempbond[i][j]);
-        }
-        free(tempcoord[i]);
-        free(querybond[i]);
-        free(tempbond[i]);
+        freeMolecule(&temp);
+        return 0;
     }
-    for (int i = 0; i < atomcount; i++)
-        free(allcands[i]);
-    free(candcounts);
-    free(allcands);
-    free(assign);
-    free(bestassign);
-    free(queryatom);
-    free(tempatom);
-    free(tempcoord);
-    free(querybond);
-    free(querycoord);
-    free(tempbond);
-    free(querynums);
-    free(tempnums);
-    rmsd.optimal_mapping = optimal_mapping;
+    *rmsd = scorePose(ref, &temp, NULL, DBL_MAX);
+    freeMolecule(&temp);
+    return 1;
+}
+
+void dock_rmsd_stream_free(Mol2Reader *reader)
+{
+    free(reader);
+}
+
+void freeMolecule(Molecule *mol)
+{
+    free(mol->x);
+    free(mol->y);
+    free(mol->z);
+    free(mol->elements);
+    free(mol->nums);
+    free(mol->bondstarts);
+    free(mol->neighbors);
+    free(mol->bondtypes);
+}
+
+// Computes the bonding tree hash of every atom at every depth from mindepth to maxdepth,
+// hashes[(depth - mindepth) * atomcount + atom]
+// The bonding tree of an atom at a given depth has one leaf per path walking depth bonds away from it without
+// going back, a path ending early when its last atom has no other neighbor. Every path is hashed as the product of
+// the tokens of its atoms and a tree as the sum of its paths modulo a prime: two trees get the same hash if and only if
+// they have the same leaves, up to a collision probability of about depth / 2^61.
+// Sums are propagated along the bonds from the deepest atoms, Morgan style, so that no path is ever enumerated.
+// All bond types are read as generic "b" when generalflag is set
+void treeHashes(const Molecule *mol, int mindepth, int maxdepth, int generalflag, uint64_t *hashes)
+{
+    int atomcount = mol->atomcount;
+    int entries = mol->bondstarts[atomcount];
+    int *owners = (int *)malloc(sizeof(int) * (entries + 1)); // Atom of which each adjacency entry is a neighbor
+    uint64_t *current = (uint64_t *)malloc(sizeof(uint64_t) * (entries + 1));
+    uint64_t *previous = (uint64_t *)malloc(sizeof(uint64_t) * (entries + 1));
+    for (int i = 0; i < atomcount; i++)
+    {
+        for (int e = mol->bondstarts[i]; e < mol->bondstarts[i + 1]; e++)
+        {
+            owners[e] = i;
+        }
+    }
+    for (int depth = mindepth; depth <= maxdepth; depth++)
+    {
+        // Sum of the paths below every entry, from the one left bond away from the end of the paths up to the root
+        for (int remaining = 0; remaining < depth; remaining++)
+        {
+            for (int e = 0; e < entries; e++)
+            {
+                int atom = mol->neighbors[e];
+                uint64_t value = tokenHash(depth - remaining, generalflag ? BONDGENERAL : mol->bondtypes[e], mol->elements[atom]);
+                if (remaining)
+                {
+                    uint64_t sum = 0;
+                    int children = 0;
+                    for (int f = mol->bondstarts[atom]; f < mol->bondstarts[atom + 1]; f++)
+                    {
+                        if (mol->neighbors[f] != owners[e])
+                        { // Don't go back to the atom we just came from
+                            sum = addMod(sum, previous[f]);
+                            children = 1;
+                        }
+                    }
+                    if (children)
+                    {
+                        value = mulMod(value, sum);
+                    }
+                }
+                current[e] = value;
+            }
+            uint64_t *swap = previous;
+            previous = current;
+            current = swap;
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            uint64_t value = tokenHash(0, 0, mol->elements[i]);
+            if (mol->bondstarts[i] < mol->bondstarts[i + 1])
+            {
+                uint64_t sum = 0;
+                for (int e = mol->bondstarts[i]; e < mol->bondstarts[i + 1]; e++)
+                {
+                    sum = addMod(sum, previous[e]);
+                }
+                value = mulMod(value, sum);
+            }
+            hashes[(depth - mindepth) * atomcount + i] = value;
+        }
+    }
+    free(owners);
+    free(current);
+    free(previous);
+}
+
+#define TASKSPERTHREAD 16  // Tasks a parallel mapping search is split into per thread, for idle threads to take more
+#ifndef PARALLELNODES
+#define PARALLELNODES 65536 // Nodes walked by one thread before a mapping search is split between threads
+#endif
+#define LIMITCHECK 256      // Nodes a walk visits between two additions to the node count and checks of the deadline
+
+// Candidates of every query atom sorted by distance, and the other data read by the walks of a mapping search
+typedef struct AssignSearch
+{
+    int atomcount;
+    int **allcands;
+    int *candcounts;
+    double **dists;  // Squared distances of every candidate
+    const Molecule *query;
+    const Molecule *temp;
+    double closest;  // Sum of the closest candidate of every atom
+    double seed;     // Total a mapping has to beat to be kept
+    int64_t shared;  // Bits of the lowest total found by any walk, see sharedTotal
+    int splitdepth;  // Levels assigned by every task of a parallel search
+    int taskcount;
+    int taskcapacity;
+    int *prefixes;      // Candidate indices (histinds) of the splitdepth first levels of every task
+    double *tasktotals; // Lowest total found below every task, DBL_MAX if none
+    int *taskassigns;   // Mapping with this total, atomcount per task
+    int firstonly;      // Threshold mode: the first mapping found below the seed ends the search
+    int stop;           // Set when a walk ends the whole search, read by every walk
+    const struct AssignStack *walked; // Serial walk a parallel search continues, its tasks already searched are skipped
+    SearchLimits limits;
+} AssignSearch;
+
+// State of one depth-first walk of the mappings
+typedef struct AssignStack
+{
+    int *assign;
+    int *history;      // Query atom assigned at every level
+    int *histinds;     // Next candidate to try at every level
+    char *used;        // Flags of the template atoms already in assign
+    int *connectcount; // Assigned neighbors of every query atom
+    // Squared distances of the atoms assigned before each position of history, kept per position so that
+    // backtracking doesn't subtract and accumulate rounding errors
+    double *totals;
+    // Lower bound of the squared distances of the atoms not assigned before each position: the sum of their closest
+    // candidate, which any complete mapping has to pay
+    double *bounds;
+    int *bestassign;
+    double bestTotal;
+    long long nodes; // Nodes visited by this walk
+    int level;       // Level the walk stopped at when its budget ran out, where it resumes
+} AssignStack;
+
+// The lowest total found by the walks of a search is shared as the bits of a double: totals are never negative, so
+// their bits order as integers and an integer compare and swap lowers them
+static inline double sharedTotal(AssignSearch *search)
+{
+#ifdef _WIN32
+    int64_t bits = InterlockedCompareExchange64((volatile LONG64 *)&search->shared, 0, 0);
+#else
+    int64_t bits = __atomic_load_n(&search->shared, __ATOMIC_RELAXED);
+#endif
+    double total;
+    memcpy(&total, &bits, sizeof(total));
+    return total;
+}
+
+static inline void lowerSharedTotal(AssignSearch *search, double total)
+{
+    int64_t bits;
+    memcpy(&bits, &total, sizeof(bits));
+#ifdef _WIN32
+    int64_t current = InterlockedCompareExchange64((volatile LONG64 *)&search->shared, 0, 0);
+    while (bits < current)
+    {
+        int64_t previous = InterlockedCompareExchange64((volatile LONG64 *)&search->shared, bits, current);
+        if (previous == current)
+        {
+            break;
+        }
+        current = previous;
+    }
+#else
+    int64_t current = __atomic_load_n(&search->shared, __ATOMIC_RELAXED);
+    while (bits < current && !__atomic_compare_exchange_n(&search->shared, &current, bits, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    { // current is reloaded by a failed exchange
+    }
+#endif
+}
+
+static inline int searchStopped(AssignSearch *search)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange((volatile LONG *)&search->stop, 0, 0);
+#else
+    return __atomic_load_n(&search->stop, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline void stopSearch(AssignSearch *search)
+{
+#ifdef _WIN32
+    InterlockedExchange((volatile LONG *)&search->stop, 1);
+#else
+    __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+// Starts the limits of a mapping search starting at start
+static void startLimits(SearchLimits *limits, const DockRMSDOptions *options, double start)
+{
+    limits->maxnodes = options->maxnodes;
+    limits->deadline = options->timelimit > 0 ? start + options->timelimit : 0;
+    limits->nodes = 0;
+    limits->truncated = 0;
+}
+
+// Adds nodes visited by a walk to the count of the search, returns the new count
+static inline int64_t countNodes(SearchLimits *limits, long long nodes)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd64((volatile LONG64 *)&limits->nodes, nodes) + nodes;
+#else
+    return __atomic_add_fetch(&limits->nodes, nodes, __ATOMIC_RELAXED);
+#endif
+}
+
+// Tells whether a walk visiting its walked-th node reached a limit of its search, and marks the search truncated if
+// so. The node limit is checked at every node against the count of the search and the nodes of the walk not added
+// yet, so one walk stops exactly there and every other walk adds less than LIMITCHECK nodes to it. The deadline is
+// only checked every LIMITCHECK nodes
+static inline int limitReached(SearchLimits *limits, long long walked)
+{
+    if (!limits->maxnodes && !limits->deadline)
+    {
+        return 0;
+    }
+    int64_t nodes;
+    int late = 0;
+    if (walked % LIMITCHECK == 0)
+    {
+        nodes = countNodes(limits, LIMITCHECK);
+        late = limits->deadline && wallSeconds() >= limits->deadline;
+    }
+    else if (limits->maxnodes)
+    {
+#ifdef _WIN32
+        nodes = InterlockedCompareExchange64((volatile LONG64 *)&limits->nodes, 0, 0) + walked % LIMITCHECK;
+#else
+        nodes = __atomic_load_n(&limits->nodes, __ATOMIC_RELAXED) + walked % LIMITCHECK;
+#endif
+    }
+    else
+    {
+        return 0;
+    }
+    if (late || (limits->maxnodes && nodes > limits->maxnodes))
+    {
+#ifdef _WIN32
+        InterlockedExchange((volatile LONG *)&limits->truncated, 1);
+#else
+        __atomic_store_n(&limits->truncated, 1, __ATOMIC_RELAXED);
+#endif
+        return 1;
+    }
+    return 0;
+}
+
+// Empties a walk for it to start again from the root
+void resetStack(const AssignSearch *search, AssignStack *stack)
+{
+    int atomcount = search->atomcount;
+    memset(stack->histinds, 0, sizeof(int) * atomcount);
+    memset(stack->used, 0, sizeof(char) * atomcount);
+    memset(stack->connectcount, 0, sizeof(int) * atomcount);
+    for (int i = 0; i < atomcount; i++)
+    {
+        stack->assign[i] = -1;
+        stack->bestassign[i] = -1;
+    }
+    stack->totals[0] = 0.0;
+    stack->bounds[0] = search->closest;
+    stack->bestTotal = search->seed;
+    stack->nodes = 0;
+    stack->level = 0;
+}
+
+void initStack(const AssignSearch *search, AssignStack *stack)
+{
+    int atomcount = search->atomcount;
+    stack->assign = (int *)malloc(sizeof(int) * atomcount);
+    stack->history = (int *)malloc(sizeof(int) * atomcount);
+    stack->histinds = (int *)malloc(sizeof(int) * atomcount);
+    stack->used = (char *)malloc(sizeof(char) * atomcount);
+    stack->connectcount = (int *)malloc(sizeof(int) * atomcount);
+    stack->totals = (double *)malloc(sizeof(double) * (atomcount + 1));
+    stack->bounds = (double *)malloc(sizeof(double) * (atomcount + 1));
+    stack->bestassign = (int *)malloc(sizeof(int) * atomcount);
+    resetStack(search, stack);
+}
+
+// Copies a walk stopped by its budget, for the copy to resume it
+static void copyStack(const AssignSearch *search, const AssignStack *from, AssignStack *stack)
+{
+    int atomcount = search->atomcount;
+    initStack(search, stack);
+    memcpy(stack->assign, from->assign, sizeof(int) * atomcount);
+    memcpy(stack->history, from->history, sizeof(int) * atomcount);
+    memcpy(stack->histinds, from->histinds, sizeof(int) * atomcount);
+    memcpy(stack->used, from->used, sizeof(char) * atomcount);
+    memcpy(stack->connectcount, from->connectcount, sizeof(int) * atomcount);
+    memcpy(stack->totals, from->totals, sizeof(double) * (atomcount + 1));
+    memcpy(stack->bounds, from->bounds, sizeof(double) * (atomcount + 1));
+    memcpy(stack->bestassign, from->bestassign, sizeof(int) * atomcount);
+    stack->bestTotal = from->bestTotal;
+    stack->level = from->level;
+}
+
+void freeStack(AssignStack *stack)
+{
+    free(stack->assign);
+    free(stack->history);
+    free(stack->histinds);
+    free(stack->used);
+    free(stack->connectcount);
+    free(stack->totals);
+    free(stack->bounds);
+    free(stack->bestassign);
+}
+
+// Picks the query atom assigned at a level: few candidates first, then many neighbors already assigned
+static void pickAtom(const AssignSearch *search, AssignStack *stack, int index)
+{
+    const Molecule *query = search->query;
+    int nextAtom = 0;
+    double bestMetric = DBL_MAX;
+    for (int i = 0; i < search->atomcount; i++)
+    {
+        double nodescore = -0.1 * ((double)stack->connectcount[i]) + 1.0 * ((double)search->candcounts[i]);
+        if (nodescore < bestMetric && stack->assign[i] == -1)
+        {
+            nextAtom = i;
+            bestMetric = nodescore;
+        }
+    }
+    stack->history[index] = nextAtom;
+    for (int e = query->bondstarts[nextAtom]; e < query->bondstarts[nextAtom + 1]; e++)
+    {
+        stack->connectcount[query->neighbors[e]]++;
+    }
+}
+
+// Assigns the candidate cand of the atom of a level and moves to the next level
+static void pushAssign(const AssignSearch *search, AssignStack *stack, int index, int cand, double otherbound)
+{
+    int atom = stack->history[index];
+    if (stack->assign[atom] >= 0)
+    { // Release the template atom of the previous mapping of this atom
+        stack->used[stack->assign[atom]] = 0;
+    }
+    stack->assign[atom] = search->allcands[atom][cand];
+    stack->used[stack->assign[atom]] = 1;
+    stack->histinds[index] = cand + 1;
+    stack->totals[index + 1] = stack->totals[index] + search->dists[atom][cand];
+    stack->bounds[index + 1] = otherbound;
+}
+
+// Unassigns the atom of a level, the walk goes back to the previous level
+static void popAssign(const AssignSearch *search, AssignStack *stack, int index)
+{
+    const Molecule *query = search->query;
+    int atom = stack->history[index];
+    stack->histinds[index] = 0;
+    if (stack->assign[atom] >= 0)
+    {
+        stack->used[stack->assign[atom]] = 0;
+    }
+    stack->assign[atom] = -1;
+    for (int e = query->bondstarts[atom]; e < query->bondstarts[atom + 1]; e++)
+    {
+        stack->connectcount[query->neighbors[e]]--;
+    }
+}
+
+// Records the candidates of the first search->splitdepth levels of a walk as a task of a parallel search
+static void addTask(AssignSearch *search, const AssignStack *stack)
+{
+    if (search->taskcount == search->taskcapacity)
+    {
+        search->taskcapacity = 2 * search->taskcapacity + 16;
+        search->prefixes = (int *)realloc(search->prefixes, sizeof(int) * search->taskcapacity * search->splitdepth);
+    }
+    memcpy(search->prefixes + search->taskcount * search->splitdepth, stack->histinds, sizeof(int) * search->splitdepth);
+    search->taskcount++;
+}
+
+// Depth-first search of the mappings below the fixed first levels of a walk, which it doesn't change, from the level
+// its budget last ran out at
+// Reaching leafdepth levels completes a mapping, or a task of a parallel search when leafdepth is not the atom count
+// Returns 0 if it stopped after budget nodes, a negative budget being unlimited, 1 when every mapping was searched or
+// a walk or a limit stopped the search
+int walkAssigns(AssignSearch *search, AssignStack *stack, int fixed, int leafdepth, long long budget)
+{
+    int atomcount = search->atomcount;
+    int **allcands = search->allcands;
+    int *candcounts = search->candcounts;
+    double **dists = search->dists;
+    int *history = stack->history;
+    int *histinds = stack->histinds;
+    int index = stack->level > fixed ? stack->level : fixed;
+    while (budget--)
+    { // While not all mappings have been searched
+        if (searchStopped(search))
+        {
+            return 1;
+        }
+        if (limitReached(&search->limits, ++stack->nodes))
+        { // The other walks stop too
+            stopSearch(search);
+            return 1;
+        }
+        if (index == leafdepth)
+        {
+            if (leafdepth < atomcount)
+            {
+                addTask(search, stack);
+            }
+            else if (stack->totals[atomcount] < stack->bestTotal)
+            { // If we've reached the end of a mapping and haven't been pruned
+                memcpy(stack->bestassign, stack->assign, sizeof(int) * atomcount);
+                stack->bestTotal = stack->totals[atomcount];
+                lowerSharedTotal(search, stack->bestTotal);
+                if (search->firstonly)
+                {
+                    stopSearch(search);
+                    return 1;
+                }
+            }
+            index--;
+            continue;
+        }
+        if (histinds[index])
+        { // Atom to analyze has been picked, we need to change the mapping
+            while (index > fixed && histinds[index] == candcounts[history[index]])
+            {
+                popAssign(search, stack, index);
+                index--;
+            }
+            if (index == fixed && histinds[fixed] == candcounts[history[fixed]])
+            { // This occurs when all mappings have been exhausted
+                return 1;
+            }
+        }
+        else
+        { // Pick an atom to analyze
+            pickAtom(search, stack, index);
+        }
+        int foundflag = 0;
+        // Mappings found by the other walks prune this one too, raised like the seed so that rounding errors of the
+        // bound don't cut their ties, which may come first in the serial order
+        double bestTotal = sharedTotal(search) * (1.0 + 1e-9) + DBL_MIN;
+        if (stack->bestTotal < bestTotal)
+        {
+            bestTotal = stack->bestTotal;
+        }
+        // Closest candidates of the other atoms still to assign, candidates being sorted by distance
+        double otherbound = stack->bounds[index] - dists[history[index]][0];
+        for (int i = histinds[index]; i < candcounts[history[index]]; i++)
+        {
+
+            if (stack->totals[index] + dists[history[index]][i] + otherbound > bestTotal)
+            { // Dead end elimination check, later candidates are further away
+                break;
+            }
+
+            if (!stack->used[allcands[history[index]][i]] && validateBonds(stack->assign, allcands[history[index]][i], history[index], search->query, search->temp))
+            { // Feasibility check
+                foundflag = 1;
+                pushAssign(search, stack, index, i, otherbound);
+                index++;
+                break;
+            }
+        }
+        if (!foundflag)
+        { // This occurs if none of the remaining possibilities can be mapped
+            if (index == fixed)
+            {
+                return 1;
+            }
+            popAssign(search, stack, index);
+            index--;
+        }
+    }
+    stack->level = index;
+    return 0;
+}
+
+// Replays the candidates of the levels first to depth - 1 of a task on a walk assigning the levels before first
+static void replayTask(AssignSearch *search, AssignStack *stack, const int *prefix, int first, int depth)
+{
+    for (int index = first; index < depth; index++)
+    {
+        pickAtom(search, stack, index);
+        pushAssign(search, stack, index, prefix[index] - 1, stack->bounds[index] - search->dists[stack->history[index]][0]);
+    }
+}
+
+// Splits a search in tasks at the shallowest level with enough walks reaching it for every thread to take several
+// The tasks of a level are listed by walking every task of the level above one level deeper, in order: they are the
+// ones a walk from the root would list, without walking the levels above again. A task only replays the levels it
+// doesn't share with the previous one
+// The walks listing the tasks don't count against the node limit of the search, only its deadline stops them
+void splitAssigns(AssignSearch *search, int nthreads)
+{
+    long long maxnodes = search->limits.maxnodes;
+    int64_t nodes = search->limits.nodes;
+    search->limits.maxnodes = 0;
+    search->prefixes = NULL;
+    search->taskcount = 0;
+    search->taskcapacity = 0;
+    search->splitdepth = 1;
+    AssignStack stack;
+    initStack(search, &stack);
+    walkAssigns(search, &stack, 0, 1, -1);
+    while (search->taskcount && search->taskcount < TASKSPERTHREAD * nthreads &&
+           search->splitdepth + 1 < search->atomcount && !searchStopped(search))
+    {
+        int *prefixes = search->prefixes;
+        int taskcount = search->taskcount;
+        int depth = search->splitdepth;
+        search->prefixes = NULL;
+        search->taskcount = 0;
+        search->taskcapacity = 0;
+        search->splitdepth = depth + 1;
+        resetStack(search, &stack);
+        for (int task = 0; task < taskcount && !searchStopped(search); task++)
+        {
+            const int *prefix = prefixes + task * depth;
+            int shared = 0;
+            if (task > 0)
+            { // Unassign the level walked and the ones after the levels shared with the previous task
+                const int *previous = prefix - depth;
+                while (prefix[shared] == previous[shared])
+                {
+                    shared++;
+                }
+                for (int index = depth; index >= shared; index--)
+                {
+                    popAssign(search, &stack, index);
+                }
+            }
+            replayTask(search, &stack, prefix, shared, depth);
+            walkAssigns(search, &stack, depth, depth + 1, -1);
+        }
+        free(prefixes);
+    }
+    freeStack(&stack);
+    search->limits.maxnodes = maxnodes;
+    search->limits.nodes = nodes;
+}
+
+// Tells where a walk stopped by its budget is in depth-first order against the first levels of a task: 1 if it went
+// past them, every mapping below was searched, 0 if it is below them, -1 if it didn't reach them. At the level of the
+// walk, a candidate picked is one whose mappings were all searched
+static int walkedTask(const AssignStack *walked, const int *prefix, int depth)
+{
+    for (int index = 0; index < depth; index++)
+    {
+        if (index > walked->level || !walked->histinds[index])
+        {
+            return -1;
+        }
+        if (prefix[index] != walked->histinds[index] || index == walked->level)
+        {
+            return prefix[index] <= walked->histinds[index] ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+// Job of parallelFor: replays the first levels of a task and walks the mappings below them
+void assignTask(void *context, int task)
+{
+    AssignSearch *search = (AssignSearch *)context;
+    const int *prefix = search->prefixes + task * search->splitdepth;
+    int walked = search->walked ? walkedTask(search->walked, prefix, search->splitdepth) : -1;
+    search->tasktotals[task] = DBL_MAX;
+    if (walked == 1)
+    { // The walk that started the search already went through it
+        return;
+    }
+    AssignStack stack;
+    if (walked == 0)
+    { // The walk that started the search stopped below it, the task carries on from there
+        copyStack(search, search->walked, &stack);
+    }
+    else
+    {
+        initStack(search, &stack);
+        replayTask(search, &stack, prefix, 0, search->splitdepth);
+    }
+    walkAssigns(search, &stack, search->splitdepth, search->atomcount, -1);
+    countNodes(&search->limits, stack.nodes % LIMITCHECK);
+    search->tasktotals[task] = stack.bestassign[0] >= 0 ? stack.bestTotal : DBL_MAX;
+    memcpy(search->taskassigns + (size_t)task * search->atomcount, stack.bestassign, sizeof(int) * search->atomcount);
+    freeStack(&stack);
+}
+
+// Walks the rest of the mappings of a search on nthreads threads after the serial walk ran out of budget, returns
+// the lowest total found, the one of the walk if none is lower, and copies its mapping in bestassign, left untouched
+// if there is none. Tasks the walk went through are skipped, the one it stopped in resumes it, the mapping it found
+// is kept
+// Tasks are ordered as the serial walk reaches them and ties go to the earliest mapping, so the mapping is the one the
+// serial walk returns whichever thread finds it first; pruning on the shared total only cuts strictly worse mappings
+double parallelAssigns(AssignSearch *search, const AssignStack *walked, int nthreads, int *bestassign)
+{
+    double bestTotal = search->seed;
+    if (walked->bestassign[0] >= 0)
+    {
+        bestTotal = walked->bestTotal;
+        memcpy(bestassign, walked->bestassign, sizeof(int) * search->atomcount);
+    }
+    // The tasks get the nodes the serial walk left, its deadline is the one of the search
+    countNodes(&search->limits, walked->nodes % LIMITCHECK);
+    splitAssigns(search, nthreads);
+    int taskcount = search->taskcount;
+    search->tasktotals = (double *)malloc(sizeof(double) * (taskcount + 1));
+    search->taskassigns = (int *)malloc(sizeof(int) * ((size_t)taskcount * search->atomcount + 1));
+    search->walked = walked;
+    parallelFor(taskcount, nthreads, assignTask, search);
+    search->walked = NULL;
+    for (int task = 0; task < taskcount; task++)
+    {
+        if (search->tasktotals[task] < bestTotal)
+        {
+            bestTotal = search->tasktotals[task];
+            memcpy(bestassign, search->taskassigns + (size_t)task * search->atomcount, sizeof(int) * search->atomcount);
+        }
+    }
+    free(search->prefixes);
+    free(search->tasktotals);
+    free(search->taskassigns);
+    return bestTotal;
+}
+
+// Squared distance between atom i of a molecule and atom j of another
+static inline double squaredDist(const Molecule *first, int i, const Molecule *second, int j)
+{
+    double dx = first->x[i] - second->x[j];
+    double dy = first->y[i] - second->y[j];
+    double dz = first->z[i] - second->z[j];
+    return dx * dx + dy * dy + dz * dz;
+}
+
+// Squared distances between a point and count atoms whose coordinates are stored side by side in x, y and z
+// Every kernel adds the squares in the same order without fused multiply-add, they give the same bits
+typedef void (*DistKernel)(double px, double py, double pz, const double *x, const double *y, const double *z, int count, double *dists);
+
+static void distRowScalar(double px, double py, double pz, const double *x, const double *y, const double *z, int count, double *dists)
+{
+    for (int j = 0; j < count; j++)
+    {
+        double dx = px - x[j];
+        double dy = py - y[j];
+        double dz = pz - z[j];
+        dists[j] = dx * dx + dy * dy + dz * dz;
+    }
+}
+
+#ifdef SIMDKERNELS
+__attribute__((target("avx2"))) NOCONTRACT static void distRowAvx2(double px, double py, double pz, const double *x, const double *y, const double *z, int count, double *dists)
+{
+    __m256d vx = _mm256_set1_pd(px);
+    __m256d vy = _mm256_set1_pd(py);
+    __m256d vz = _mm256_set1_pd(pz);
+    int j = 0;
+    for (; j + 4 <= count; j += 4)
+    {
+        __m256d dx = _mm256_sub_pd(vx, _mm256_loadu_pd(x + j));
+        __m256d dy = _mm256_sub_pd(vy, _mm256_loadu_pd(y + j));
+        __m256d dz = _mm256_sub_pd(vz, _mm256_loadu_pd(z + j));
+        __m256d sum = _mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy));
+        _mm256_storeu_pd(dists + j, _mm256_add_pd(sum, _mm256_mul_pd(dz, dz)));
+    }
+    distRowScalar(px, py, pz, x + j, y + j, z + j, count - j, dists + j);
+}
+
+__attribute__((target("avx512f"))) NOCONTRACT static void distRowAvx512(double px, double py, double pz, const double *x, const double *y, const double *z, int count, double *dists)
+{
+    __m512d vx = _mm512_set1_pd(px);
+    __m512d vy = _mm512_set1_pd(py);
+    __m512d vz = _mm512_set1_pd(pz);
+    for (int j = 0; j < count; j += 8)
+    { // The last lanes past count are masked off
+        __mmask8 mask = count - j >= 8 ? 0xff : (__mmask8)((1u << (count - j)) - 1);
+        __m512d dx = _mm512_sub_pd(vx, _mm512_maskz_loadu_pd(mask, x + j));
+        __m512d dy = _mm512_sub_pd(vy, _mm512_maskz_loadu_pd(mask, y + j));
+        __m512d dz = _mm512_sub_pd(vz, _mm512_maskz_loadu_pd(mask, z + j));
+        __m512d sum = _mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy));
+        _mm512_mask_storeu_pd(dists + j, mask, _mm512_add_pd(sum, _mm512_mul_pd(dz, dz)));
+    }
+}
+#endif // SIMDKERNELS
+
+// Returns the widest distance kernel the processor runs
+DistKernel distKernel(void)
+{
+#ifdef SIMDKERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        return distRowAvx512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return distRowAvx2;
+    }
+#endif
+    return distRowScalar;
+}
+
+// Atoms of a molecule grouped by element, with their coordinates side by side for the distance kernels
+typedef struct ElementClasses
+{
+    int count;
+    uint64_t *keys; // Element code in the high half, atom in the low half, sorted: atoms of an element are contiguous
+    int *atoms;     // Atom of every entry of keys
+    double *x;      // Coordinates of every entry of keys
+    double *y;
+    double *z;
+} ElementClasses;
+
+void elementClasses(const Molecule *mol, ElementClasses *classes, Arena *arena)
+{
+    int count = mol->atomcount;
+    classes->count = count;
+    classes->keys = (uint64_t *)arenaAlloc(arena, sizeof(uint64_t) * (count + 1));
+    classes->atoms = (int *)arenaAlloc(arena, sizeof(int) * (count + 1));
+    classes->x = (double *)arenaAlloc(arena, sizeof(double) * (3 * count + 1));
+    classes->y = classes->x + count;
+    classes->z = classes->y + count;
+    for (int i = 0; i < count; i++)
+    {
+        classes->keys[i] = ((uint64_t)mol->elements[i] << 32) | (uint64_t)i;
+    }
+    qsort(classes->keys, count, sizeof(uint64_t), hashcompar);
+    for (int k = 0; k < count; k++)
+    {
+        int atom = (int)(classes->keys[k] & 0xffffffffu);
+        classes->atoms[k] = atom;
+        classes->x[k] = mol->x[atom];
+        classes->y[k] = mol->y[atom];
+        classes->z[k] = mol->z[atom];
+    }
+}
+
+// Returns the first entry of the atoms of an element and their number in *size, in atom order
+int elementClass(const ElementClasses *classes, int element, int *size)
+{
+    uint64_t key = (uint64_t)element << 32;
+    int low = 0;
+    int high = classes->count;
+    while (low < high)
+    { // First entry not below the element
+        int middle = (low + high) / 2;
+        if (classes->keys[middle] < key)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    int end = low;
+    while (end < classes->count && (classes->keys[end] >> 32) == (uint64_t)element)
+    {
+        end++;
+    }
+    *size = end - low;
+    return low;
+}
+
+// Candidate of a query atom with its squared distance
+typedef struct DistCandidate
+{
+    double dist;
+    int atom;
+} DistCandidate;
+
+// Comparator for compatibility with qsort: by distance, then by template atom as candidates are listed
+int distcompar(const void *a, const void *b)
+{
+    const DistCandidate *first = (const DistCandidate *)a;
+    const DistCandidate *second = (const DistCandidate *)b;
+    if (first->dist != second->dist)
+    {
+        return (first->dist > second->dist) - (first->dist < second->dist);
+    }
+    return (first->atom > second->atom) - (first->atom < second->atom);
+}
+
+double searchAssigns(int atomcount, int **allcands,
+                     int candcounts[], const Molecule *temp,
+                     const Molecule *query, const Symmetry *symmetry,
+                     const DockRMSDOptions *options, double bound,
+                     int *bestassign, DockRMSD *rmsd, Arena *arena)
+{
+    int nthreads = options->threads;
+    double threshold = options->threshold;
+    double **dists = (double **)arenaAlloc(arena, sizeof(double *) * atomcount); // Distances between query atoms and template atoms
+    ElementClasses classes;
+    elementClasses(temp, &classes, arena);
+    DistKernel kernel = distKernel();
+    // precalculate the squared distances between query atoms and their candidates, the only ones the search reads
+    for (int i = 0; i < atomcount; i++)
+    {
+        *(bestassign + i) = -1;
+        double *distind = (double *)arenaAlloc(arena, sizeof(double) * (candcounts[i] + 1));
+        int size;
+        int first = elementClass(&classes, query->elements[i], &size);
+        if (candcounts[i] == size)
+        { // Every atom of the element is a candidate, in the same order
+            kernel(query->x[i], query->y[i], query->z[i], classes.x + first, classes.y + first, classes.z + first, size, distind);
+        }
+        else
+        {
+            for (int j = 0; j < candcounts[i]; j++)
+            {
+                *(distind + j) = squaredDist(query, i, temp, *(*(allcands + i) + j));
+            }
+        }
+        *(dists + i) = distind;
+    }
+
+    // sort all possible atoms at each position by query-template distance, equal distances keeping the template order
+    DistCandidate *sorted = (DistCandidate *)arenaAlloc(arena, sizeof(DistCandidate) * (atomcount + 1));
+    for (int index = 0; index < atomcount; index++)
+    {
+        for (int i = 0; i < candcounts[index]; i++)
+        {
+            sorted[i].dist = dists[index][i];
+            sorted[i].atom = allcands[index][i];
+        }
+        qsort(sorted, candcounts[index], sizeof(DistCandidate), distcompar);
+        for (int i = 0; i < candcounts[index]; i++)
+        {
+            dists[index][i] = sorted[i].dist;
+            allcands[index][i] = sorted[i].atom;
+        }
+    }
+    AssignSearch search;
+    memset(&search, 0, sizeof(AssignSearch));
+    search.atomcount = atomcount;
+    search.allcands = allcands;
+    search.candcounts = candcounts;
+    search.dists = dists;
+    search.query = query;
+    search.temp = temp;
+    for (int i = 0; i < atomcount; i++)
+    {
+        search.closest += *(*(dists + i));
+    }
+
+    // Start from the optimal assignment repaired for the bonds, slightly raised so that the search still finds and
+    // returns the first optimal mapping in its own order
+    double bestTotal = DBL_MAX;
+    double seed = DBL_MAX;
+    int solved = 0;
+    int optimal = 0;
+    double cutoff = threshold * threshold * atomcount; // Total of the threshold in threshold mode
+    // Total above which the pose is abandoned, raised like the seed so that a mapping at the bound is still found
+    double limit = bound < DBL_MAX ? bound * bound * atomcount * (1.0 + 1e-9) + DBL_MIN : DBL_MAX;
+    int *lapassign = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    int *repaired = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    double lower = classAssign(atomcount, allcands, candcounts, dists, lapassign, arena);
+    // Total no mapping is below: the assignment ignoring bonds, or the mapping found when it is proven optimal
+    double lowerTotal = lower;
+    if (lower < DBL_MAX)
+    {
+        seed = repairAssign(atomcount, allcands, candcounts, dists, lapassign, query, temp, repaired, arena);
+        if (lower > limit)
+        { // Even the assignment ignoring bonds is above the bound
+            solved = 1;
+        }
+        else if (threshold > 0 && (seed <= cutoff || lower > cutoff))
+        { // Threshold mode: the seed is within the threshold, or the assignment ignoring bonds, a lower bound of every
+          // mapping, is not
+            solved = 1;
+            if (seed < DBL_MAX)
+            {
+                bestTotal = seed;
+                memcpy(bestassign, repaired, sizeof(int) * atomcount);
+            }
+        }
+        else if (seed < DBL_MAX && symmetry->levels >= 0)
+        { // Every valid mapping is this one with an automorphism of the query applied, no need to search the others
+            double start = wallSeconds();
+            double symmetrylower;
+            startLimits(&search.limits, options, start);
+            bestTotal = symmetricSearch(symmetry, query, temp, repaired, &search.limits, &symmetrylower, arena);
+            rmsd->search_seconds = wallSeconds() - start;
+            memcpy(bestassign, repaired, sizeof(int) * atomcount);
+            solved = 1;
+            optimal = !search.limits.truncated;
+            lowerTotal = optimal ? bestTotal : fmax(lower, symmetrylower);
+        }
+        else if (seed < DBL_MAX)
+        {
+            bestTotal = seed * (1.0 + 1e-9) + DBL_MIN;
+        }
+    }
+    if (!solved && threshold > 0 && cutoff * (1.0 + 1e-9) + DBL_MIN < bestTotal)
+    { // Only a mapping within the threshold is searched for
+        bestTotal = cutoff * (1.0 + 1e-9) + DBL_MIN;
+    }
+    if (!solved && limit < bestTotal)
+    {
+        bestTotal = limit;
+    }
+    search.firstonly = threshold > 0;
+    search.seed = bestTotal;
+    memcpy(&search.shared, &bestTotal, sizeof(bestTotal));
+    if (nthreads <= 0)
+    {
+        nthreads = cpuCount();
+    }
+    if (!solved)
+    { // Searches too long for one thread start again on all of them, pruned by the mappings already found
+        double start = wallSeconds();
+        startLimits(&search.limits, options, start);
+        AssignStack stack;
+        initStack(&search, &stack);
+        if (walkAssigns(&search, &stack, 0, atomcount, nthreads > 1 && atomcount > 1 ? PARALLELNODES : -1))
+        {
+            bestTotal = stack.bestTotal;
+            memcpy(bestassign, stack.bestassign, sizeof(int) * atomcount);
+        }
+        else
+        {
+            bestTotal = parallelAssigns(&search, &stack, nthreads, bestassign);
+        }
+        freeStack(&stack);
+        rmsd->search_seconds = wallSeconds() - start;
+        int exhausted = !search.limits.truncated && !(search.firstonly && search.stop);
+        if (exhausted)
+        { // Nothing is below the mapping found, or below the total the search started from
+            optimal = *bestassign != -1;
+            lowerTotal = optimal ? bestTotal : fmax(lower, search.seed);
+        }
+        if (*bestassign == -1 && seed < DBL_MAX && (threshold > 0 || search.limits.truncated))
+        { // No mapping within the threshold or before the limit, the best one found is the seed
+            bestTotal = seed;
+            memcpy(bestassign, repaired, sizeof(int) * atomcount);
+        }
+    }
+    if (!optimal && bestTotal <= lowerTotal)
+    { // The mapping found reaches the lower bound
+        optimal = 1;
+    }
+    rmsd->optimal = optimal && *bestassign != -1;
+    rmsd->lower_bound = lowerTotal < DBL_MAX ? sqrt(lowerTotal / atomcount) : DBL_MAX;
+    if (*bestassign != -1)
+    {
+        return pow(bestTotal / ((double)atomcount), 0.5);
+    }
+    else
+    {
+        return DBL_MAX;
+    }
+}
+
+// Checks if the assignment of the current atom is feasible
+int validateBonds(int *atomassign, int proposedatom,
+                  int assignpos, const Molecule *query,
+                  const Molecule *temp)
+{
+    for (int j = query->bondstarts[assignpos]; j < query->bondstarts[assignpos + 1]; j++)
+    {
+        int assignatom = *(atomassign + query->neighbors[j]);
+        if (assignatom >= 0 && findBond(temp, proposedatom, assignatom) < 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Returns the bonding tree hashes of the template at every depth of the reference, in hashes unless they were prepared
+const uint64_t *templateTrees(const DockRMSDReference *ref, const Molecule *temp, const uint64_t *temptrees, int generalflag, uint64_t *hashes)
+{
+    if (temptrees)
+    {
+        return temptrees + treeIndex(ref, generalflag, 1, 0);
+    }
+    treeHashes(temp, 1, ref->depth, generalflag, hashes);
+    return hashes;
+}
+
+// Returns the lowest RMSD of all possible mappings for query atoms with template indices given the two molecules' bonding network
+DockRMSD assignAtoms(const DockRMSDReference *ref, Molecule *temp,
+                     const uint64_t *temptrees, double bound, int generalflag, int simpleflag,
+                     DockRMSD rmsd, Arena *arena)
+{
+    double start = wallSeconds();
+    int atomcount = ref->mol.atomcount;
+    int *queryatom = ref->mol.elements;
+    int *tempatom = temp->elements;
+    int **allcands = (int **)arenaCalloc(arena, atomcount, sizeof(int *)); // List of all atoms in the template that could feasibly be each query atom
+    int *candcounts = (int *)arenaAlloc(arena, atomcount * sizeof(int));  // Number of atoms in the template that could feasibly be each query atom
+    uint64_t *hashes = temptrees ? NULL : (uint64_t *)arenaAlloc(arena, sizeof(uint64_t) * ((size_t)ref->depth * atomcount + 1));
+    int *candidates = (int *)arenaAlloc(arena, atomcount * sizeof(int));  // Flags corresponding to if each template atom could correspond to the current query atom
+    const uint64_t *ttrees = templateTrees(ref, temp, temptrees, generalflag, hashes); // Template bonding tree hashes
+    // Iterate through each query atom and determine which template atoms correspond to the query
+    for (int i = 0; i < atomcount; i++)
+    {
+        int viablecands = 0; // Count of template atoms that could correspond to the current query atom
+        for (int j = 0; j < atomcount; j++)
+        {
+            candidates[j] = queryatom[i] == tempatom[j];
+            viablecands += candidates[j];
+        }
+        for (int treedepth = 1; treedepth <= ref->depth; treedepth++)
+        {
+            uint64_t qtree = ref->trees[treeIndex(ref, generalflag, treedepth, i)];
+            const uint64_t *ttree = ttrees + (treedepth - 1) * atomcount;
+            for (int j = 0; j < atomcount; j++)
+            {
+                if (candidates[j] && ttree[j] != qtree)
+                { // If the template atom tree and query atom tree don't have the same leaves, they're not the same atom
+                    candidates[j] = 0;
+                    viablecands--;
+                }
+            }
+        }
+        if (!viablecands)
+        { // If there's no possible atom, something went wrong or the two molecules are not identical
+            if (!generalflag)
+            {
+                if (!simpleflag)
+                {
+                    char *formatstring = NULL;
+                    if (0 <= asprintf(&formatstring, "No atoms mappable for atom %d, generalizing bonds...\n", i))
+                        setError(&rmsd, formatstring, 1);
+                }
+                generalflag = 1;
+                for (int j = 0; j < i; j++)
+                {
+                    *(allcands + j) = NULL;
+                    candcounts[j] = 0;
+                }
+                ttrees = templateTrees(ref, temp, temptrees, generalflag, hashes);
+                i = -1;
+                continue;
+            }
+            else
+            {
+                char *formatstring = NULL;
+                if (0 <= asprintf(&formatstring, "Atom assignment failed for atom %d.\n", i))
+                    setError(&rmsd, formatstring, 1);
+                return rmsd;
+            }
+        }
+        else
+        { // Otherwise, store all possible template atoms for this query atom
+            candcounts[i] = viablecands;
+            int *atomcands = (int *)arenaAlloc(arena, sizeof(int) * viablecands);
+            int k = 0;
+            for (int j = 0; j < atomcount; j++)
+            {
+                if (candidates[j])
+                {
+                    *(atomcands + k) = j;
+                    k++;
+                    if (k == viablecands)
+                    {
+                        break;
+                    }
+                }
+            }
+            *(allcands + i) = atomcands;
+        }
+    }
+    double possiblemaps = 1.0;
+    for (int i = 0; i < atomcount; i++)
+        possiblemaps *= candcounts[i];
+
+    // Calculate RMSD of all possible mappings given each query atoms possible template atoms and return the minimum
+    int *bestassign = (int *)arenaAlloc(arena, atomcount * sizeof(int));
+    double bestrmsd = searchAssigns(atomcount, allcands, candcounts, temp, &ref->mol,
+                                    &ref->symmetry[generalflag], &ref->options, bound, bestassign, &rmsd, arena);
+    rmsd.setup_seconds = wallSeconds() - start - rmsd.search_seconds;
+    rmsd.rmsd = bestrmsd;
+    rmsd.total_of_possible_mappings = possiblemaps;
+    if (bestrmsd == DBL_MAX)
+    {
+        if (ref->options.threshold > 0)
+        {
+            setError(&rmsd, "No mapping found within the threshold\n", 0);
+        }
+        else if (bound < DBL_MAX)
+        {
+            setError(&rmsd, "No mapping found below the bound\n", 0);
+        }
+        else if (rmsd.lower_bound < DBL_MAX)
+        { // A search limit stopped the search before it found a mapping or proved there is none
+            setError(&rmsd, "No mapping found before the search limit\n", 0);
+        }
+        else
+        {
+            setError(&rmsd, "No valid mapping exists\n", 0);
+        }
+        return rmsd;
+    }
+    rmsd.mapping = mappingRows(&ref->mol, temp, bestassign);
+    return rmsd;
+}
+
+// Returns the rows of DockRMSD.mapping for an assignment of query atoms on template indices
+int *mappingRows(const Molecule *query, const Molecule *temp, const int *assign)
+{
+    int atomcount = query->atomcount;
+    int *rows = (int *)malloc(sizeof(int) * ((MAPPINGCOLUMNS + 1) * atomcount + 1));
+    if (!rows)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < atomcount; i++)
+    {
+        rows[i * MAPPINGCOLUMNS] = assign[i];
+        rows[i * MAPPINGCOLUMNS + 1] = query->nums[i];
+        rows[i * MAPPINGCOLUMNS + 2] = temp->nums[assign[i]];
+        rows[MAPPINGCOLUMNS * atomcount + i] = query->elements[i];
+    }
+    return rows;
+}
+
+// Renders the mapping of a result as text once, in a buffer sized for the longest lines, and returns it
+const char *dock_rmsd_mapping_text(DockRMSD *rmsd)
+{
+    if (*rmsd->optimal_mapping || !rmsd->mapping)
+    {
+        return rmsd->optimal_mapping;
+    }
+    int atomcount = rmsd->_querycount;
+    const int *rows = rmsd->mapping;
+    const int *elements = rows + MAPPINGCOLUMNS * atomcount;
+    const char *header = "Optimal mapping (First file -> Second file, * indicates correspondence is not one-to-one):\n";
+    // A line is two elements of 2 characters, two numbers of at most 11, the arrow, a space and the end "*\n"
+    size_t capacity = strlen(header) + (size_t)atomcount * 34 + 1;
+    char *text = (char *)malloc(capacity);
+    if (!text)
+    {
+        return rmsd->optimal_mapping;
+    }
+    size_t length = strlen(header);
+    memcpy(text, header, length + 1);
+    char element[3];
+    for (int i = 0; i < atomcount; i++)
+    {
+        const int *row = rows + i * MAPPINGCOLUMNS;
+        elementName(elements[i], element);
+        length += snprintf(text + length, capacity - length, "%s%3d -> %s%3d %s\n", element, row[1], element, row[2],
+                           row[1] == row[2] ? "" : "*");
+    }
+    rmsd->optimal_mapping = text;
+    return text;
+}
+
+// Solves the linear assignment problem of a n x n cost matrix (row major), rowassign[row] receives its column
+// Jonker-Volgenant: column reduction then successive shortest augmenting paths with row and column potentials, O(n^3)
+// Returns the total cost of the assignment
+double lapSolve(int n, const double *cost, int *rowassign, Arena *arena)
+{
+    // Rows and columns are numbered from 1, column 0 holds the row being inserted
+    double *rowpot = (double *)arenaCalloc(arena, n + 1, sizeof(double));
+    double *colpot = (double *)arenaCalloc(arena, n + 1, sizeof(double));
+    double *mincost = (double *)arenaAlloc(arena, sizeof(double) * (n + 1)); // Reduced cost of the shortest path to every column
+    int *colrow = (int *)arenaCalloc(arena, n + 1, sizeof(int));              // Row assigned to every column, 0 if free
+    char *rowtaken = (char *)arenaCalloc(arena, n + 1, sizeof(char));
+    int *way = (int *)arenaAlloc(arena, sizeof(int) * (n + 1)); // Previous column on the shortest path
+    char *visited = (char *)arenaAlloc(arena, sizeof(char) * (n + 1));
+    for (int col = 1; col <= n; col++)
+    { // Column reduction: every column is priced at its cheapest row, which takes it while still free
+        int best = 1;
+        for (int row = 2; row <= n; row++)
+        {
+            if (cost[(row - 1) * n + col - 1] < cost[(best - 1) * n + col - 1])
+            {
+                best = row;
+            }
+        }
+        colpot[col] = cost[(best - 1) * n + col - 1];
+        if (!rowtaken[best])
+        {
+            rowtaken[best] = 1;
+            colrow[col] = best;
+        }
+    }
+    for (int row = 1; row <= n; row++)
+    {
+        if (rowtaken[row])
+        {
+            continue;
+        }
+        colrow[0] = row;
+        int col0 = 0;
+        for (int col = 0; col <= n; col++)
+        {
+            mincost[col] = DBL_MAX;
+            visited[col] = 0;
+        }
+        do
+        { // Grow the shortest path tree until it reaches a free column
+            visited[col0] = 1;
+            int row0 = colrow[col0];
+            int col1 = 0;
+            double delta = DBL_MAX;
+            for (int col = 1; col <= n; col++)
+            {
+                if (!visited[col])
+                {
+                    double reduced = cost[(row0 - 1) * n + col - 1] - rowpot[row0] - colpot[col];
+                    if (reduced < mincost[col])
+                    {
+                        mincost[col] = reduced;
+                        way[col] = col0;
+                    }
+                    if (mincost[col] < delta)
+                    {
+                        delta = mincost[col];
+                        col1 = col;
+                    }
+                }
+            }
+            for (int col = 0; col <= n; col++)
+            {
+                if (visited[col])
+                {
+                    rowpot[colrow[col]] += delta;
+                    colpot[col] -= delta;
+                }
+                else
+                {
+                    mincost[col] -= delta;
+                }
+            }
+            col0 = col1;
+        } while (colrow[col0]);
+        do
+        { // Augment along the path
+            int col1 = way[col0];
+            colrow[col0] = colrow[col1];
+            col0 = col1;
+        } while (col0);
+    }
+    double total = 0.0;
+    for (int col = 1; col <= n; col++)
+    {
+        rowassign[colrow[col] - 1] = col - 1;
+    }
+    for (int row = 0; row < n; row++)
+    {
+        total += cost[row * n + rowassign[row]];
+    }
+    return total;
+}
+
+// Solves the assignment of every query atom to one of its candidates minimizing the sum of squared distances,
+// ignoring the bonds. Query atoms with the same candidates form a class solved on its own: candidates of two atoms
+// are the same or disjoint as they are picked by element and bonding trees.
+// lapassign[i] receives the position of the chosen candidate in allcands[i], dists[i] holding their distances
+// Returns the sum of squared distances, a lower bound of every mapping, or DBL_MAX if the classes don't match
+double classAssign(int atomcount, int **allcands, int candcounts[], double **dists, int *lapassign, Arena *arena)
+{
+    int *mark = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1));   // Query atom whose class a template atom is in
+    int *colpos = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1)); // Column of a template atom in the cost matrix of its class
+    int *members = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1));
+    char *done = (char *)arenaCalloc(arena, atomcount + 1, sizeof(char));
+    double *cost = NULL;
+    int *rowassign = NULL;
+    int capacity = 0; // Largest class the cost matrix was allocated for
+    double total = 0.0;
+    for (int t = 0; t < atomcount; t++)
+    {
+        mark[t] = -1;
+    }
+    for (int i = 0; i < atomcount && total < DBL_MAX; i++)
+    {
+        if (done[i])
+        {
+            continue;
+        }
+        int size = candcounts[i];
+        if (!size)
+        {
+            total = DBL_MAX;
+            break;
+        }
+        for (int j = 0; j < size; j++)
+        {
+            mark[allcands[i][j]] = i;
+            colpos[allcands[i][j]] = j;
+        }
+        int membercount = 0;
+        for (int q = i; q < atomcount; q++)
+        {
+            if (done[q] || !candcounts[q] || mark[allcands[q][0]] != i)
+            {
+                continue;
+            }
+            for (int j = 0; j < candcounts[q]; j++)
+            {
+                if (mark[allcands[q][j]] != i || candcounts[q] != size)
+                { // Overlapping candidates, the atoms can't be split into classes
+                    total = DBL_MAX;
+                }
+            }
+            done[q] = 1;
+            if (membercount < size)
+            {
+                members[membercount] = q;
+            }
+            membercount++;
+        }
+        if (total == DBL_MAX || membercount != size)
+        { // More or less atoms than candidates, no mapping exists
+            total = DBL_MAX;
+            break;
+        }
+        if (size > capacity)
+        {
+            cost = (double *)arenaAlloc(arena, sizeof(double) * size * size);
+            rowassign = (int *)arenaAlloc(arena, sizeof(int) * size);
+            capacity = size;
+        }
+        for (int a = 0; a < size; a++)
+        {
+            int q = members[a];
+            for (int j = 0; j < size; j++)
+            {
+                cost[a * size + colpos[allcands[q][j]]] = dists[q][j];
+            }
+        }
+        total += lapSolve(size, cost, rowassign, arena);
+        for (int a = 0; a < size; a++)
+        {
+            int q = members[a];
+            int target = allcands[i][rowassign[a]];
+            for (int j = 0; j < size; j++)
+            {
+                if (allcands[q][j] == target)
+                {
+                    lapassign[q] = j;
+                }
+            }
+        }
+    }
+    return total;
+}
+
+// Builds a mapping respecting the bonds from an assignment given as candidate positions: atoms are taken in breadth
+// first order, so that each is bonded to an atom already mapped, and try their assigned candidate first then the
+// others from the closest, backtracking on dead ends. Returns the sum of squared distances of the first mapping
+// found, stored in mapping, DBL_MAX if none is found within REPAIRBUDGET steps per atom
+#define REPAIRBUDGET 64
+
+double repairAssign(int atomcount, int **allcands, int candcounts[], double **dists, const int *lapassign,
+                    const Molecule *query, const Molecule *temp, int *mapping, Arena *arena)
+{
+    int *assign = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1));
+    int *order = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1));
+    char *used = (char *)arenaCalloc(arena, atomcount + 1, sizeof(char));
+    char *seen = (char *)arenaCalloc(arena, atomcount + 1, sizeof(char));
+    int tail = 0;
+    for (int start = 0; start < atomcount; start++)
+    {
+        assign[start] = -1;
+        if (seen[start])
+        {
+            continue;
+        }
+        seen[start] = 1;
+        order[tail++] = start;
+        for (int head = tail - 1; head < tail; head++)
+        {
+            int atom = order[head];
+            for (int e = query->bondstarts[atom]; e < query->bondstarts[atom + 1]; e++)
+            {
+                if (!seen[query->neighbors[e]])
+                {
+                    seen[query->neighbors[e]] = 1;
+                    order[tail++] = query->neighbors[e];
+                }
+            }
+        }
+    }
+    int *tries = (int *)arenaCalloc(arena, atomcount + 1, sizeof(int));   // Next candidate to try at each position, 0 for the assigned one
+    int *chosen = (int *)arenaAlloc(arena, sizeof(int) * (atomcount + 1)); // Candidate position picked at each position
+    long long budget = (long long)REPAIRBUDGET * atomcount;
+    int k = 0;
+    while (k >= 0 && k < atomcount && budget-- > 0)
+    {
+        int i = order[k];
+        if (assign[i] >= 0)
+        { // Coming back to this position, release its previous candidate
+            used[assign[i]] = 0;
+            assign[i] = -1;
+        }
+        int pick = -1;
+        while (pick < 0 && tries[k] <= candcounts[i])
+        {
+            int j = tries[k] ? tries[k] - 1 : lapassign[i];
+            if ((!tries[k] || j != lapassign[i]) && !used[allcands[i][j]] && validateBonds(assign, allcands[i][j], i, query, temp))
+            {
+                pick = j;
+            }
+            tries[k]++;
+        }
+        if (pick < 0)
+        { // Dead end, go back to the previous position
+            tries[k] = 0;
+            k--;
+            continue;
+        }
+        chosen[k] = pick;
+        assign[i] = allcands[i][pick];
+        used[assign[i]] = 1;
+        k++;
+    }
+    double total = DBL_MAX;
+    if (k == atomcount)
+    {
+        total = 0.0;
+        for (k = 0; k < atomcount; k++)
+        {
+            total += dists[order[k]][chosen[k]];
+        }
+        memcpy(mapping, assign, sizeof(int) * atomcount);
+    }
+    return total;
+}
+
+// Returns the RMSD of the optimal assignment of every query atom to a template atom of the same element,
+// regardless of the bonds, as the Hungarian algorithm does
+DockRMSD hungarianAssign(const DockRMSDReference *ref, Molecule *temp, DockRMSD rmsd, Arena *arena)
+{
+    double start = wallSeconds();
+    int atomcount = ref->mol.atomcount;
+    int **allcands = (int **)arenaAlloc(arena, sizeof(int *) * atomcount);
+    int *candcounts = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    double **dists = (double **)arenaAlloc(arena, sizeof(double *) * atomcount);
+    int *lapassign = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    ElementClasses classes;
+    elementClasses(temp, &classes, arena);
+    DistKernel kernel = distKernel();
+    for (int i = 0; i < atomcount; i++)
+    { // Candidates are all the template atoms of the same element
+        int first = elementClass(&classes, ref->mol.elements[i], &candcounts[i]);
+        allcands[i] = (int *)arenaAlloc(arena, sizeof(int) * (candcounts[i] + 1));
+        dists[i] = (double *)arenaAlloc(arena, sizeof(double) * (candcounts[i] + 1));
+        memcpy(allcands[i], classes.atoms + first, sizeof(int) * candcounts[i]);
+        kernel(ref->mol.x[i], ref->mol.y[i], ref->mol.z[i], classes.x + first, classes.y + first, classes.z + first, candcounts[i], dists[i]);
+    }
+    double searchstart = wallSeconds();
+    double total = classAssign(atomcount, allcands, candcounts, dists, lapassign, arena);
+    rmsd.setup_seconds = searchstart - start;
+    rmsd.search_seconds = wallSeconds() - searchstart;
+    rmsd.total_of_possible_mappings = 1;
+    if (total == DBL_MAX)
+    {
+        setError(&rmsd, "No valid mapping exists\n", 0);
+    }
+    else
+    {
+        int *assign = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+        for (int i = 0; i < atomcount; i++)
+        {
+            assign[i] = allcands[i][lapassign[i]];
+        }
+        rmsd.rmsd = sqrt(total / atomcount);
+        rmsd.mapping = mappingRows(&ref->mol, temp, assign);
+        rmsd.optimal = 1;
+        rmsd.lower_bound = rmsd.rmsd;
+    }
+    return rmsd;
+}
+
+#define INDIVIDUALIZED 0x5bd1e9955bd1e995ULL // Salt of the color of an atom singled out from its class
+#define SYMMETRYBUDGET 256                   // Refinement steps allowed per atom to compute the automorphism group
+
+// Color of an atom singled out from its class when the coloring has count colors. Every atom singled out raises the
+// count, so colors of atoms singled out one after the other never collide even if refinement left their class as is
+static inline uint64_t individualize(uint64_t color, int count)
+{
+    return mixHash(color ^ (INDIVIDUALIZED + (uint64_t)count));
+}
+
+// Returns the number of distinct hashes of an array, using an open addressing table of mask + 1 slots, a power of two
+// above count. Slots are filled in this round when their stamp is round, so the table never needs to be cleared
+static int countHashes(const uint64_t *values, int count, uint64_t *table, int *stamps, int mask, int round)
+{
+    int distinct = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int slot = (int)(values[i] & mask);
+        while (stamps[slot] == round && table[slot] != values[i])
+        {
+            slot = (slot + 1) & mask;
+        }
+        if (stamps[slot] != round)
+        {
+            stamps[slot] = round;
+            table[slot] = values[i];
+            distinct++;
+        }
+    }
+    return distinct;
+}
+
+// Refines a coloring of the atoms until atoms of the same color have as many neighbors of every color, as color
+// refinement does. Colors are hashes of the previous color and of the neighbor colors, so two colorings exchanged by
+// a permutation of the atoms are still exchanged by it once refined. Returns the number of colors
+int refineColors(const Molecule *mol, uint64_t *colors)
+{
+    int atomcount = mol->atomcount;
+    int size = 2;
+    while (size < 2 * atomcount)
+    {
+        size <<= 1;
+    }
+    uint64_t *next = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *mixed = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1)); // Colors as summed by the neighbors
+    uint64_t *table = (uint64_t *)malloc(sizeof(uint64_t) * size);
+    int *stamps = (int *)calloc(size, sizeof(int));
+    int round = 1;
+    int count = countHashes(colors, atomcount, table, stamps, size - 1, round++);
+    while (count < atomcount)
+    {
+        for (int i = 0; i < atomcount; i++)
+        {
+            mixed[i] = mixHash(colors[i]);
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            uint64_t sum = 0;
+            for (int e = mol->bondstarts[i]; e < mol->bondstarts[i + 1]; e++)
+            {
+                sum += mixed[mol->neighbors[e]];
+            }
+            next[i] = mixHash(colors[i] ^ mixHash(sum));
+        }
+        int refined = countHashes(next, atomcount, table, stamps, size - 1, round++);
+        if (refined == count)
+        { // Equitable, the new colors only rename the previous ones
+            break;
+        }
+        memcpy(colors, next, sizeof(uint64_t) * atomcount);
+        count = refined;
+    }
+    free(next);
+    free(mixed);
+    free(table);
+    free(stamps);
+    return count;
+}
+
+// Searches for an automorphism of the molecule turning the source coloring into the target one by individualization
+// and refinement: the first atom of a class is singled out in the source and every atom of that class in the target,
+// until the colorings are discrete. The automorphism is stored in perm, it also preserves the initial colors.
+// Colorings are modified. Returns 0 if there is none, or if the budget of refinements is exhausted
+int matchColorings(const Molecule *mol, const uint64_t *initial, uint64_t *source, uint64_t *target, int *perm,
+                   long long *budget)
+{
+    int atomcount = mol->atomcount;
+    if (--*budget < 0)
+    {
+        return 0;
+    }
+    int count = refineColors(mol, source);
+    if (refineColors(mol, target) != count)
+    {
+        return 0;
+    }
+    uint64_t *sorted = (uint64_t *)malloc(sizeof(uint64_t) * (2 * atomcount + 1));
+    memcpy(sorted, source, sizeof(uint64_t) * atomcount);
+    memcpy(sorted + atomcount, target, sizeof(uint64_t) * atomcount);
+    qsort(sorted, atomcount, sizeof(uint64_t), hashcompar);
+    qsort(sorted + atomcount, atomcount, sizeof(uint64_t), hashcompar);
+    int found = !memcmp(sorted, sorted + atomcount, sizeof(uint64_t) * atomcount);
+    if (found && count == atomcount)
+    { // Discrete colorings, atoms of the same color are the image of each other
+        int *positions = (int *)malloc(sizeof(int) * (atomcount + 1));
+        for (int j = 0; j < atomcount; j++)
+        {
+            positions[(uint64_t *)bsearch(&target[j], sorted, atomcount, sizeof(uint64_t), hashcompar) - sorted] = j;
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            perm[i] = positions[(uint64_t *)bsearch(&source[i], sorted, atomcount, sizeof(uint64_t), hashcompar) - sorted];
+        }
+        for (int i = 0; i < atomcount && found; i++)
+        {
+            found = initial[i] == initial[perm[i]];
+            for (int e = mol->bondstarts[i]; e < mol->bondstarts[i + 1] && found; e++)
+            {
+                found = findBond(mol, perm[i], perm[mol->neighbors[e]]) >= 0;
+            }
+        }
+        free(positions);
+    }
+    else if (found)
+    {
+        int atom = -1;
+        int atomclass = atomcount + 1;
+        for (int start = 0, end = 0; start < atomcount; start = end)
+        { // Smallest class, singled out from its first atom
+            while (end < atomcount && sorted[end] == sorted[start])
+            {
+                end++;
+            }
+            if (end - start > 1 && end - start < atomclass)
+            {
+                atomclass = end - start;
+                atom = start;
+            }
+        }
+        uint64_t smallest = sorted[atom];
+        atom = 0;
+        while (source[atom] != smallest)
+        {
+            atom++;
+        }
+        found = 0;
+        uint64_t color = source[atom];
+        uint64_t *sourcecopy = (uint64_t *)malloc(sizeof(uint64_t) * (2 * atomcount + 1));
+        uint64_t *targetcopy = sourcecopy + atomcount;
+        for (int j = 0; j < atomcount && !found && *budget >= 0; j++)
+        {
+            if (target[j] == color)
+            {
+                memcpy(sourcecopy, source, sizeof(uint64_t) * atomcount);
+                memcpy(targetcopy, target, sizeof(uint64_t) * atomcount);
+                sourcecopy[atom] = targetcopy[j] = individualize(color, count);
+                found = matchColorings(mol, initial, sourcecopy, targetcopy, perm, budget);
+            }
+        }
+        free(sourcecopy);
+    }
+    free(sorted);
+    return found;
+}
+
+// Finds the root of the set of an atom, the smallest atom of the set
+static inline int findRoot(int *parents, int atom)
+{
+    while (parents[atom] != atom)
+    {
+        parents[atom] = parents[parents[atom]];
+        atom = parents[atom];
+    }
+    return atom;
+}
+
+// Appends a permutation to the transversals, returns it or NULL if there are already capacity permutations
+static int *appendPerm(Symmetry *symmetry, int *permcount, int capacity, int atomcount)
+{
+    if (*permcount == capacity)
+    {
+        return NULL;
+    }
+    symmetry->perms = (int *)realloc(symmetry->perms, sizeof(int) * (size_t)(*permcount + 1) * atomcount);
+    return symmetry->perms + (size_t)(*permcount)++ * atomcount;
+}
+
+// Computes the automorphisms of a molecule preserving the initial colors of its atoms, as a stabilizer chain
+// Every level singles out an atom of the smallest class left by color refinement and searches an automorphism
+// mapping it to each other atom of its class. Returns 0 and leaves the group unknown if it takes more than
+// SYMMETRYBUDGET refinements per atom or more than about four automorphisms per atom
+int buildSymmetry(const Molecule *mol, const uint64_t *initial, Symmetry *symmetry)
+{
+    int atomcount = mol->atomcount;
+    int capacity = 4 * atomcount + 64; // Automorphisms kept at most
+    long long budget = (long long)SYMMETRYBUDGET * atomcount;
+    uint64_t *colors = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *sorted = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *source = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *target = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    uint64_t *stabilized = (uint64_t *)malloc(sizeof(uint64_t) * (atomcount + 1));
+    int *perm = (int *)malloc(sizeof(int) * (atomcount + 1));
+    int *transversal = (int *)malloc(sizeof(int) * (atomcount + 1)); // Permutation moving the base atom to every atom
+    int *reached = (int *)malloc(sizeof(int) * (atomcount + 1));     // Atoms of the orbit of the base atom found so far
+    int *generators = (int *)malloc(sizeof(int) * (atomcount + 1));  // Permutations found by search at this level
+    memset(symmetry, 0, sizeof(Symmetry));
+    symmetry->base = (int *)malloc(sizeof(int) * (atomcount + 1));
+    symmetry->starts = (int *)malloc(sizeof(int) * (atomcount + 2));
+    int permcount = 0;
+    int levels = 0;
+    memcpy(colors, initial, sizeof(uint64_t) * atomcount);
+    int count = refineColors(mol, colors);
+    while (count < atomcount && levels >= 0)
+    {
+        memcpy(sorted, colors, sizeof(uint64_t) * atomcount);
+        qsort(sorted, atomcount, sizeof(uint64_t), hashcompar);
+        int base = -1;
+        int baseclass = atomcount + 1;
+        for (int start = 0, end = 0; start < atomcount; start = end)
+        {
+            while (end < atomcount && sorted[end] == sorted[start])
+            {
+                end++;
+            }
+            if (end - start > 1 && end - start < baseclass)
+            {
+                baseclass = end - start;
+                base = start;
+            }
+        }
+        uint64_t color = sorted[base];
+        base = 0;
+        while (colors[base] != color)
+        {
+            base++;
+        }
+        symmetry->base[levels] = base;
+        symmetry->starts[levels] = permcount;
+        // Coloring of the next level, searches start from it on their source side
+        memcpy(stabilized, colors, sizeof(uint64_t) * atomcount);
+        stabilized[base] = individualize(color, count);
+        int stabilizedcount = refineColors(mol, stabilized);
+        int generatorcount = 0;
+        int reachedcount = 0;
+        for (int i = 0; i < atomcount; i++)
+        {
+            transversal[i] = -1;
+        }
+        int *identity = appendPerm(symmetry, &permcount, capacity, atomcount);
+        if (!identity)
+        {
+            levels = -1;
+            break;
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            identity[i] = i;
+        }
+        transversal[base] = permcount - 1;
+        reached[reachedcount++] = base;
+        for (int atom = 0; atom < atomcount && levels >= 0; atom++)
+        {
+            if (transversal[atom] >= 0 || colors[atom] != color)
+            {
+                continue;
+            }
+            memcpy(source, stabilized, sizeof(uint64_t) * atomcount);
+            memcpy(target, colors, sizeof(uint64_t) * atomcount);
+            target[atom] = individualize(color, count);
+            if (!matchColorings(mol, initial, source, target, perm, &budget))
+            {
+                levels = budget < 0 ? -1 : levels;
+                continue;
+            }
+            int *found = appendPerm(symmetry, &permcount, capacity, atomcount);
+            if (!found)
+            {
+                levels = -1;
+                break;
+            }
+            memcpy(found, perm, sizeof(int) * atomcount);
+            generators[generatorcount++] = permcount - 1;
+            transversal[atom] = permcount - 1;
+            reached[reachedcount++] = atom;
+            // Atoms the automorphisms found move the orbit to get their transversal element by composition
+            for (int head = 0; head < reachedcount && levels >= 0; head++)
+            {
+                for (int g = 0; g < generatorcount; g++)
+                {
+                    int image = symmetry->perms[(size_t)generators[g] * atomcount + reached[head]];
+                    if (transversal[image] >= 0)
+                    {
+                        continue;
+                    }
+                    int *composed = appendPerm(symmetry, &permcount, capacity, atomcount);
+                    if (!composed)
+                    {
+                        levels = -1;
+                        break;
+                    }
+                    const int *generator = symmetry->perms + (size_t)generators[g] * atomcount;
+                    const int *moved = symmetry->perms + (size_t)transversal[reached[head]] * atomcount;
+                    for (int i = 0; i < atomcount; i++)
+                    {
+                        composed[i] = generator[moved[i]];
+                    }
+                    transversal[image] = permcount - 1;
+                    reached[reachedcount++] = image;
+                }
+            }
+        }
+        if (levels >= 0)
+        {
+            memcpy(colors, stabilized, sizeof(uint64_t) * atomcount);
+            count = stabilizedcount;
+            levels++;
+        }
+    }
+    free(colors);
+    free(sorted);
+    free(source);
+    free(target);
+    free(stabilized);
+    free(perm);
+    free(transversal);
+    free(reached);
+    free(generators);
+    if (levels < 0)
+    {
+        freeSymmetry(symmetry);
+        symmetry->levels = -1;
+        return 0;
+    }
+    symmetry->levels = levels;
+    symmetry->starts[levels] = permcount;
+    // Orbits of the stabilizer of the first l base atoms, from the trivial group of the last level: the stabilizer at
+    // level l is generated by the transversal of level l and the stabilizer at level l + 1
+    symmetry->orbits = (int *)malloc(sizeof(int) * (size_t)(levels + 1) * atomcount);
+    symmetry->cycles = (int *)malloc(sizeof(int) * (size_t)(levels + 1) * atomcount);
+    int *parents = (int *)malloc(sizeof(int) * (atomcount + 1));
+    int *last = (int *)malloc(sizeof(int) * (atomcount + 1)); // Last atom of every orbit met so far
+    for (int i = 0; i < atomcount; i++)
+    {
+        parents[i] = i;
+    }
+    for (int level = levels; level >= 0; level--)
+    {
+        int *orbits = symmetry->orbits + (size_t)level * atomcount;
+        int *cycles = symmetry->cycles + (size_t)level * atomcount;
+        int end = level < levels ? symmetry->starts[level + 1] : permcount;
+        for (int p = level < levels ? symmetry->starts[level] : permcount; p < end; p++)
+        {
+            const int *image = symmetry->perms + (size_t)p * atomcount;
+            for (int i = 0; i < atomcount; i++)
+            {
+                int a = findRoot(parents, i);
+                int b = findRoot(parents, image[i]);
+                if (a < b)
+                {
+                    parents[b] = a;
+                }
+                else if (b < a)
+                {
+                    parents[a] = b;
+                }
+            }
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            orbits[i] = findRoot(parents, i);
+            if (orbits[i] != i)
+            {
+                cycles[last[orbits[i]]] = i;
+            }
+            last[orbits[i]] = i;
+        }
+        for (int i = 0; i < atomcount; i++)
+        {
+            if (orbits[i] == i)
+            { // Close the cycle from the last atom of the orbit to its smallest one
+                cycles[last[i]] = i;
+            }
+        }
+    }
+    free(parents);
+    free(last);
+    return 1;
+}
+
+// Checks that two colorings of the atoms give the same classes
+int samePartition(const uint64_t *first, const uint64_t *second, int atomcount)
+{
+    for (int i = 0; i < atomcount; i++)
+    {
+        for (int j = 0; j < i; j++)
+        {
+            if ((first[i] == first[j]) != (second[i] == second[j]))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void copySymmetry(Symmetry *copy, const Symmetry *symmetry, int atomcount)
+{
+    memset(copy, 0, sizeof(Symmetry));
+    copy->levels = symmetry->levels;
+    if (symmetry->levels < 0)
+    {
+        return;
+    }
+    int levels = symmetry->levels;
+    size_t perms = (size_t)symmetry->starts[levels] * atomcount;
+    size_t orbits = (size_t)(levels + 1) * atomcount;
+    copy->base = (int *)malloc(sizeof(int) * (levels + 1));
+    copy->starts = (int *)malloc(sizeof(int) * (levels + 1));
+    copy->perms = (int *)malloc(sizeof(int) * (perms + 1));
+    copy->orbits = (int *)malloc(sizeof(int) * orbits);
+    copy->cycles = (int *)malloc(sizeof(int) * orbits);
+    memcpy(copy->base, symmetry->base, sizeof(int) * levels);
+    memcpy(copy->starts, symmetry->starts, sizeof(int) * (levels + 1));
+    if (perms)
+    { // No permutation at all for molecules without symmetry
+        memcpy(copy->perms, symmetry->perms, sizeof(int) * perms);
+    }
+    memcpy(copy->orbits, symmetry->orbits, sizeof(int) * orbits);
+    memcpy(copy->cycles, symmetry->cycles, sizeof(int) * orbits);
+}
+
+void freeSymmetry(Symmetry *symmetry)
+{
+    free(symmetry->base);
+    free(symmetry->starts);
+    free(symmetry->perms);
+    free(symmetry->orbits);
+    free(symmetry->cycles);
+    memset(symmetry, 0, sizeof(Symmetry));
+}
+
+// Branch and bound over the automorphisms of the query, see symmetricSearch
+typedef struct SymmetrySearch
+{
+    const Symmetry *symmetry;
+    const Molecule *query;
+    const Molecule *temp;
+    const int *mapping; // Valid mapping the automorphisms are applied to
+    int *images;        // Automorphism chosen up to every level, images[l * atomcount + atom]
+    int *best;          // Best automorphism found
+    double bestTotal;
+    int *order;    // Transversal of every level sorted by distance of the image of its base atom
+    double *keys;  // Distances the transversals are sorted by
+    SearchLimits *limits;
+    long long nodes; // Nodes visited, one per automorphism prefix bounded
+    int stopped;     // Set when a limit stopped the search
+    double lowerTotal; // Total no automorphism is below, the bound of the root
+} SymmetrySearch;
+
+// Squared distance between a query atom and the template atom mapped to the query atom image
+static inline double imageDist(const SymmetrySearch *search, int atom, int image)
+{
+    return squaredDist(search->query, atom, search->temp, search->mapping[image]);
+}
+
+void symmetryBranch(SymmetrySearch *search, int level)
+{
+    if (limitReached(search->limits, ++search->nodes))
+    { // The root, the first node, is always bounded
+        search->stopped = 1;
+        return;
+    }
+    const Symmetry *symmetry = search->symmetry;
+    int atomcount = search->query->atomcount;
+    const int *images = search->images + (size_t)level * atomcount;
+    const int *cycles = symmetry->cycles + (size_t)level * atomcount;
+    // Atoms fixed by the automorphisms left have their image, the others at least the closest image of their orbit
+    double total = 0.0;
+    for (int atom = 0; atom < atomcount && total < search->bestTotal; atom++)
+    {
+        double closest = imageDist(search, atom, images[atom]);
+        for (int other = cycles[atom]; other != atom; other = cycles[other])
+        {
+            double dist = imageDist(search, atom, images[other]);
+            if (dist < closest)
+            {
+                closest = dist;
+            }
+        }
+        total += closest;
+    }
+    if (level == 0)
+    { // A total stopped at the best one only tells that nothing is below it
+        search->lowerTotal = total < search->bestTotal ? total : search->bestTotal;
+    }
+    if (total >= search->bestTotal)
+    {
+        return;
+    }
+    if (level == symmetry->levels)
+    {
+        search->bestTotal = total;
+        memcpy(search->best, images, sizeof(int) * atomcount);
+        return;
+    }
+    int first = symmetry->starts[level];
+    int count = symmetry->starts[level + 1] - first;
+    int base = symmetry->base[level];
+    int *order = search->order + first;
+    double *keys = search->keys + first;
+    for (int k = 0; k < count; k++)
+    { // Insertion sort, closest image of the base atom first
+        double key = imageDist(search, base, images[symmetry->perms[(size_t)(first + k) * atomcount + base]]);
+        int position = k;
+        while (position > 0 && keys[position - 1] > key)
+        {
+            keys[position] = keys[position - 1];
+            order[position] = order[position - 1];
+            position--;
+        }
+        keys[position] = key;
+        order[position] = first + k;
+    }
+    int *nextimages = search->images + (size_t)(level + 1) * atomcount;
+    for (int k = 0; k < count && !search->stopped; k++)
+    {
+        const int *perm = symmetry->perms + (size_t)order[k] * atomcount;
+        for (int atom = 0; atom < atomcount; atom++)
+        {
+            nextimages[atom] = images[perm[atom]];
+        }
+        symmetryBranch(search, level + 1);
+    }
+}
+
+// Returns the lowest sum of squared distances of the mappings obtained by applying the automorphisms of the query to
+// a valid mapping, which gives every valid mapping as they all map atoms on atoms with the same bonding trees.
+// mapping is replaced by the best of them. When a limit stops the search the best one found is returned and lowerTotal
+// is a total none is below, else the total returned
+double symmetricSearch(const Symmetry *symmetry, const Molecule *query, const Molecule *temp, int *mapping, SearchLimits *limits, double *lowerTotal, Arena *arena)
+{
+    int atomcount = query->atomcount;
+    int permcount = symmetry->starts[symmetry->levels];
+    SymmetrySearch search;
+    search.symmetry = symmetry;
+    search.query = query;
+    search.temp = temp;
+    search.mapping = mapping;
+    search.images = (int *)arenaAlloc(arena, sizeof(int) * (size_t)(symmetry->levels + 1) * atomcount);
+    search.best = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    search.order = (int *)arenaAlloc(arena, sizeof(int) * (permcount + 1));
+    search.keys = (double *)arenaAlloc(arena, sizeof(double) * (permcount + 1));
+    search.limits = limits;
+    search.nodes = 0;
+    search.stopped = 0;
+    search.bestTotal = 0.0;
+    for (int atom = 0; atom < atomcount; atom++)
+    { // The mapping itself bounds the search
+        search.images[atom] = atom;
+        search.best[atom] = atom;
+        search.bestTotal += imageDist(&search, atom, atom);
+    }
+    symmetryBranch(&search, 0);
+    int *best = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    for (int atom = 0; atom < atomcount; atom++)
+    {
+        best[atom] = mapping[search.best[atom]];
+    }
+    memcpy(mapping, best, sizeof(int) * atomcount);
+    *lowerTotal = search.stopped ? search.lowerTotal : search.bestTotal;
+    return search.bestTotal;
+}
+
+// Automorphism groups kept across references, so that references of the same molecule prepared again and again
+// (one-shot comparisons, batches) only compute them once. Entries are replaced in round robin
+#define SYMMETRYCACHE 64
+
+typedef struct SymmetryCacheEntry
+{
+    uint64_t key; // moleculeKey of the molecule, 0 for an empty entry
+    int depth;    // Depth of the bonding trees the automorphisms preserve
+    Molecule mol; // Elements and bonding network of the molecule, without coordinates
+    Symmetry symmetry[2];
+} SymmetryCacheEntry;
+
+static SymmetryCacheEntry symmetrycache[SYMMETRYCACHE];
+static int symmetrycachenext;
+#ifdef _WIN32
+static SRWLOCK symmetrycachelock = SRWLOCK_INIT;
+#define lockSymmetryCache() AcquireSRWLockExclusive(&symmetrycachelock)
+#define unlockSymmetryCache() ReleaseSRWLockExclusive(&symmetrycachelock)
+#else
+static pthread_mutex_t symmetrycachelock = PTHREAD_MUTEX_INITIALIZER;
+#define lockSymmetryCache() pthread_mutex_lock(&symmetrycachelock)
+#define unlockSymmetryCache() pthread_mutex_unlock(&symmetrycachelock)
+#endif
+
+// Returns a hash of the elements and bonding network of a molecule, atoms in file order
+uint64_t moleculeKey(const Molecule *mol)
+{
+    int atomcount = mol->atomcount;
+    uint64_t key = mixHash((uint64_t)atomcount + 1);
+    for (int i = 0; i < atomcount; i++)
+    {
+        key = mixHash(key ^ (uint64_t)mol->elements[i]);
+        key = mixHash(key ^ (uint64_t)mol->bondstarts[i + 1]);
+    }
+    for (int e = 0; e < mol->bondstarts[atomcount]; e++)
+    {
+        key = mixHash(key ^ ((uint64_t)mol->neighbors[e] << 32 | (uint32_t)mol->bondtypes[e]));
+    }
+    return key;
+}
+
+// Checks that two molecules have the same elements and bonding network, atoms in file order
+int sameGraph(const Molecule *first, const Molecule *second)
+{
+    int atomcount = first->atomcount;
+    if (atomcount != second->atomcount ||
+        memcmp(first->elements, second->elements, sizeof(int) * atomcount) ||
+        memcmp(first->bondstarts, second->bondstarts, sizeof(int) * (atomcount + 1)))
+    {
+        return 0;
+    }
+    int entries = first->bondstarts[atomcount];
+    return !memcmp(first->neighbors, second->neighbors, sizeof(int) * entries) &&
+           !memcmp(first->bondtypes, second->bondtypes, sizeof(int) * entries);
+}
+
+// Copies the automorphisms of a molecule from the cache, returns 0 if they aren't in it
+int cachedSymmetry(const Molecule *mol, int depth, Symmetry symmetry[2])
+{
+    if (!mol->atomcount)
+    { // Nothing to compute, and no element array to compare
+        return 0;
+    }
+    uint64_t key = moleculeKey(mol);
+    int found = 0;
+    lockSymmetryCache();
+    for (int slot = 0; slot < SYMMETRYCACHE && !found; slot++)
+    {
+        SymmetryCacheEntry *entry = &symmetrycache[slot];
+        if (entry->key == key && entry->depth == depth && sameGraph(&entry->mol, mol))
+        {
+            copySymmetry(&symmetry[0], &entry->symmetry[0], mol->atomcount);
+            copySymmetry(&symmetry[1], &entry->symmetry[1], mol->atomcount);
+            found = 1;
+        }
+    }
+    unlockSymmetryCache();
+    return found;
+}
+
+// Frees an entry of the cache and marks it empty
+void clearCacheEntry(SymmetryCacheEntry *entry)
+{
+    free(entry->mol.elements);
+    free(entry->mol.bondstarts);
+    free(entry->mol.neighbors);
+    free(entry->mol.bondtypes);
+    freeSymmetry(&entry->symmetry[0]);
+    freeSymmetry(&entry->symmetry[1]);
+    memset(entry, 0, sizeof(SymmetryCacheEntry));
+}
+
+// Stores a copy of the automorphisms of a molecule in the cache, in place of the oldest entry
+void cacheSymmetry(const Molecule *mol, int depth, const Symmetry symmetry[2])
+{
+    int atomcount = mol->atomcount;
+    if (!atomcount)
+    {
+        return;
+    }
+    int entries = mol->bondstarts[atomcount];
+    lockSymmetryCache();
+    SymmetryCacheEntry *entry = &symmetrycache[symmetrycachenext];
+    symmetrycachenext = (symmetrycachenext + 1) % SYMMETRYCACHE;
+    clearCacheEntry(entry);
+    entry->key = moleculeKey(mol);
+    entry->depth = depth;
+    entry->mol.atomcount = atomcount;
+    entry->mol.elements = (int *)malloc(sizeof(int) * (atomcount + 1));
+    entry->mol.bondstarts = (int *)malloc(sizeof(int) * (atomcount + 1));
+    entry->mol.neighbors = (int *)malloc(sizeof(int) * (entries + 1));
+    entry->mol.bondtypes = (int *)malloc(sizeof(int) * (entries + 1));
+    memcpy(entry->mol.elements, mol->elements, sizeof(int) * atomcount);
+    memcpy(entry->mol.bondstarts, mol->bondstarts, sizeof(int) * (atomcount + 1));
+    memcpy(entry->mol.neighbors, mol->neighbors, sizeof(int) * entries);
+    memcpy(entry->mol.bondtypes, mol->bondtypes, sizeof(int) * entries);
+    copySymmetry(&entry->symmetry[0], &symmetry[0], atomcount);
+    copySymmetry(&entry->symmetry[1], &symmetry[1], atomcount);
+    unlockSymmetryCache();
+}
+
+// Empties the cache of automorphism groups, to release its memory
+void dock_rmsd_clear_cache(void)
+{
+    lockSymmetryCache();
+    for (int slot = 0; slot < SYMMETRYCACHE; slot++)
+    {
+        clearCacheEntry(&symmetrycache[slot]);
+    }
+    symmetrycachenext = 0;
+    unlockSymmetryCache();
+}
+
+// Checks that a pose numbers its atoms as the reference: the same element and the same bonds with the same types
+// for every atom, so that mapping every atom on the atom of the same index is valid
+int sameNumbering(const Molecule *query, const Molecule *temp)
+{
+    for (int i = 0; i < query->atomcount; i++)
+    {
+        if (query->elements[i] != temp->elements[i])
+        {
+            return 0;
+        }
+        for (int e = query->bondstarts[i]; e < query->bondstarts[i + 1]; e++)
+        {
+            int bond = findBond(temp, i, query->neighbors[e]);
+            if (bond < 0 || temp->bondtypes[bond] != query->bondtypes[e])
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Returns the lowest RMSD of the mappings of a pose numbering its atoms as the reference: applying the automorphisms
+// of the reference to the identity gives all of them, no candidate has to be computed
+DockRMSD symmetryAssign(const DockRMSDReference *ref, Molecule *temp, DockRMSD rmsd, Arena *arena)
+{
+    int atomcount = ref->mol.atomcount;
+    int *mapping = (int *)arenaAlloc(arena, sizeof(int) * atomcount);
+    for (int i = 0; i < atomcount; i++)
+    {
+        mapping[i] = i;
+    }
+    double start = wallSeconds();
+    SearchLimits limits;
+    double lowerTotal;
+    startLimits(&limits, &ref->options, start);
+    double total = symmetricSearch(&ref->symmetry[0], &ref->mol, temp, mapping, &limits, &lowerTotal, arena);
+    rmsd.search_seconds = wallSeconds() - start;
+    rmsd.rmsd = pow(total / ((double)atomcount), 0.5);
+    rmsd.total_of_possible_mappings = ref->possiblemaps;
+    rmsd.mapping = mappingRows(&ref->mol, temp, mapping);
+    rmsd.optimal = !limits.truncated || total <= lowerTotal; // Stopped, the mapping may still reach the lower bound
+    rmsd.lower_bound = rmsd.optimal ? rmsd.rmsd : sqrt(lowerTotal / atomcount);
     return rmsd;
 }
 
+// Shared state of the workers of parallelFor
+typedef struct WorkQueue
+{
+    int next; // Next index to hand out
+    int count;
+    void (*job)(void *, int);
+    void *context;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} WorkQueue;
+
+// Worker loop: takes indices from the queue until it is exhausted
+#ifdef _WIN32
+DWORD WINAPI workQueueRun(LPVOID arg)
+#else
+void *workQueueRun(void *arg)
+#endif
+{
+    WorkQueue *queue = (WorkQueue *)arg;
+    while (1)
+    {
+#ifdef _WIN32
+        EnterCriticalSection(&queue->lock);
+        int index = queue->next++;
+        LeaveCriticalSection(&queue->lock);
+#else
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+#endif
+        if (index >= queue->count)
+        {
+            break;
+        }
+        queue->job(queue->context, index);
+    }
+    return 0;
+}
+
+// Number of threads used when the caller asks for 0
+int cpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Monotonic clock in seconds for the timings of DockRMSD
+double wallSeconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+#endif
+}
+
+// Calls job(context, index) for every index in [0, count) on a pool of nthreads threads, the caller being one of them
+// Indices are handed out one at a time so that slow jobs don't hold back the others
+void parallelFor(int count, int nthreads, void (*job)(void *, int), void *context)
+{
+    if (nthreads <= 0)
+    {
+        nthreads = cpuCount();
+    }
+    if (nthreads > count)
+    {
+        nthreads = count;
+    }
+    WorkQueue queue;
+    queue.next = 0;
+    queue.count = count;
+    queue.job = job;
+    queue.context = context;
+    if (nthreads <= 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            job(context, i);
+        }
+        return;
+    }
+#ifdef _WIN32
+    HANDLE *threads = (HANDLE *)malloc(sizeof(HANDLE) * nthreads);
+    InitializeCriticalSection(&queue.lock);
+    int started = 0;
+    for (int i = 1; i < nthreads; i++)
+    {
+        threads[started] = CreateThread(NULL, 0, workQueueRun, &queue, 0, NULL);
+        if (threads[started])
+        {
+            started++;
+        }
+    }
+    workQueueRun(&queue);
+    WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+    DeleteCriticalSection(&queue.lock);
+#else
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * nthreads);
+    pthread_mutex_init(&queue.lock, NULL);
+    int started = 0;
+    for (int i = 1; i < nthreads; i++)
+    {
+        if (!pthread_create(&threads[started], NULL, workQueueRun, &queue))
+        {
+            started++;
+        }
+    }
+    workQueueRun(&queue); // If no thread could be started the caller does all the work
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+#endif
+    free(threads);
+}
+
+// Arguments of dock_rmsd_batch shared by its jobs
+typedef struct BatchJob
+{
+    const Mol2Source *queries;
+    const Mol2Source *templates;
+    DockRMSD *results;
+    const DockRMSDOptions *options;
+} BatchJob;
+
+// Gives the content of a batch source, mapping it when it is a path, returns 0 if it can't be read
+int openSource(const Mol2Source *source, Mol2Map *map)
+{
+    if (source->path)
+    {
+        return dock_rmsd_map(source->path, map);
+    }
+    memset(map, 0, sizeof(Mol2Map));
+    map->data = source->data;
+    map->size = source->size;
+    return 1;
+}
+
+void closeSource(const Mol2Source *source, Mol2Map *map)
+{
+    if (source->path)
+    {
+        dock_rmsd_unmap(map);
+    }
+}
+
+void batchJob(void *context, int index)
+{
+    BatchJob *batch = (BatchJob *)context;
+    const Mol2Source *query = batch->queries + index;
+    const Mol2Source *template = batch->templates + index;
+    DockRMSD rmsd = {0, 0, "", "", 0, 0, 0, 0, 0, NULL, 0, 0, 0};
+    Mol2Map querymap;
+    Mol2Map tempmap;
+    if (!openSource(query, &querymap))
+    {
+        rmsd.error = QUERYREADERROR;
+    }
+    else
+    {
+        if (!openSource(template, &tempmap))
+        {
+            rmsd.error = TEMPLATEREADERROR;
+        }
+        else
+        {
+            DockRMSDReference *ref = dock_rmsd_reference_buffer(querymap.data, querymap.size);
+            if (ref && dock_rmsd_reference_set_options(ref, batch->options))
+            {
+                rmsd = dock_rmsd_pose_buffer(ref, tempmap.data, tempmap.size);
+            }
+            else
+            {
+                rmsd.error = QUERYMOLECULEERROR;
+            }
+            dock_rmsd_reference_free(ref);
+            closeSource(template, &tempmap);
+        }
+        closeSource(query, &querymap);
+    }
+    batch->results[index] = rmsd;
+}
+
+// Compares count (query, template) pairs on nthreads threads, 0 meaning one thread per core
+// Every computation only touches its own memory, the results are stored in pair order
+// options apply to every pair, NULL for dock_rmsd_default_options
+void dock_rmsd_batch(const Mol2Source *queries, const Mol2Source *templates, DockRMSD *results, int count, int nthreads, const DockRMSDOptions *options)
+{
+    DockRMSDOptions defaults = dock_rmsd_default_options();
+    BatchJob batch = {queries, templates, results, options ? options : &defaults};
+    parallelFor(count, nthreads, batchJob, &batch);
+}
+
+// Arguments of dock_rmsd_pairwise shared by its jobs
+typedef struct PairwiseJob
+{
+    const Mol2Source *poses;
+    DockRMSDReference **refs; // Every pose prepared as a reference, NULL if it can't be read
+    int count;
+    const DockRMSDOptions *options;
+    double *condensed;
+} PairwiseJob;
+
+// Parses a source and prepares it as a reference with the given options, NULL if it can't be read
+DockRMSDReference *prepareSource(const Mol2Source *source, const DockRMSDOptions *options)
+{
+    Mol2Map map;
+    DockRMSDReference *ref = NULL;
+    if (openSource(source, &map))
+    {
+        ref = dock_rmsd_reference_buffer(map.data, map.size);
+        if (ref && !dock_rmsd_reference_set_options(ref, options))
+        {
+            dock_rmsd_reference_free(ref);
+            ref = NULL;
+        }
+        closeSource(source, &map);
+    }
+    return ref;
+}
+
+// Prepares the poses after the first one
+void prepareJob(void *context, int index)
+{
+    PairwiseJob *pairwise = (PairwiseJob *)context;
+    pairwise->refs[index + 1] = prepareSource(pairwise->poses + index + 1, pairwise->options);
+}
+
+// Compares pose index with every later pose, their RMSDs are a row of the condensed matrix
+void pairwiseJob(void *context, int index)
+{
+    PairwiseJob *pairwise = (PairwiseJob *)context;
+    int count = pairwise->count;
+    double *row = pairwise->condensed + (size_t)index * count - (size_t)index * (index + 1) / 2;
+    DockRMSDReference *ref = pairwise->refs[index];
+    for (int j = index + 1; j < count; j++)
+    {
+        DockRMSDReference *pose = pairwise->refs[j];
+        row[j - index - 1] = NAN;
+        if (!ref || !pose)
+        {
+            continue;
+        }
+        DockRMSD rmsd = scorePose(ref, &pose->mol, pose->depth == ref->depth ? pose->trees : NULL, DBL_MAX);
+        if (rmsd.mapping)
+        {
+            row[j - index - 1] = rmsd.rmsd;
+        }
+        dock_rmsd_free(&rmsd);
+    }
+}
+
+// Fills the condensed distance matrix of count poses of one molecule: the RMSD of every pair i < j, row by row, at
+// index count * i - i * (i + 1) / 2 + j - i - 1, NAN when no mapping exists or a pose can't be read
+// Every pose is parsed and prepared once, the first alone so that the others find its automorphisms in the cache
+void dock_rmsd_pairwise(const Mol2Source *poses, int count, double *condensed, int nthreads, const DockRMSDOptions *options)
+{
+    DockRMSDOptions defaults = dock_rmsd_default_options();
+    DockRMSDReference **refs = (DockRMSDReference **)calloc(count + 1, sizeof(DockRMSDReference *));
+    PairwiseJob pairwise = {poses, refs, count, options ? options : &defaults, condensed};
+    if (!refs)
+    {
+        for (size_t k = 0; k < (size_t)count * (count - 1) / 2; k++)
+        {
+            condensed[k] = NAN;
+        }
+        return;
+    }
+    if (count > 0)
+    {
+        refs[0] = prepareSource(poses, pairwise.options);
+        parallelFor(count - 1, nthreads, prepareJob, &pairwise);
+    }
+    parallelFor(count, nthreads, pairwiseJob, &pairwise);
+    for (int i = 0; i < count; i++)
+    {
+        dock_rmsd_reference_free(refs[i]);
+    }
+    free(refs);
+}
+
+// Arguments of dock_rmsd_top_k shared by its jobs, the poses kept so far are guarded by lock
+typedef struct TopJob
+{
+    const DockRMSDReference *ref;
+    const Mol2Source *poses;
+    int k;
+    int kept;
+    DockRMSD *results; // Best poses so far, by increasing RMSD then index
+    int *indices;
+#ifdef _WIN32
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} TopJob;
+
+static void lockTop(TopJob *top)
+{
+#ifdef _WIN32
+    EnterCriticalSection(&top->lock);
+#else
+    pthread_mutex_lock(&top->lock);
+#endif
+}
+
+static void unlockTop(TopJob *top)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(&top->lock);
+#else
+    pthread_mutex_unlock(&top->lock);
+#endif
+}
+
+// Scores a pose below the RMSD of the k-th best pose so far, and keeps it if it takes its place
+void topJob(void *context, int index)
+{
+    TopJob *top = (TopJob *)context;
+    const Mol2Source *pose = top->poses + index;
+    Mol2Map map;
+    if (!openSource(pose, &map))
+    {
+        return;
+    }
+    Mol2Reader reader = bufferReader(map.data, map.size);
+    Molecule temp;
+    readNextMolecule(&reader, &temp, HFLAG);
+    closeSource(pose, &map);
+    lockTop(top);
+    double bound = top->kept == top->k ? top->results[top->k - 1].rmsd : DBL_MAX;
+    unlockTop(top);
+    DockRMSD rmsd = scorePose(top->ref, &temp, NULL, bound);
+    freeMolecule(&temp);
+    if (!rmsd.mapping)
+    {
+        dock_rmsd_free(&rmsd);
+        return;
+    }
+    lockTop(top);
+    int position = top->kept;
+    while (position > 0 && (rmsd.rmsd < top->results[position - 1].rmsd ||
+                            (rmsd.rmsd == top->results[position - 1].rmsd && index < top->indices[position - 1])))
+    {
+        position--;
+    }
+    if (position < top->k)
+    {
+        if (top->kept == top->k)
+        { // The k-th best pose is pushed out
+            dock_rmsd_free(&top->results[top->k - 1]);
+            top->kept--;
+        }
+        memmove(top->results + position + 1, top->results + position, sizeof(DockRMSD) * (top->kept - position));
+        memmove(top->indices + position + 1, top->indices + position, sizeof(int) * (top->kept - position));
+        top->results[position] = rmsd;
+        top->indices[position] = index;
+        top->kept++;
+    }
+    else
+    {
+        dock_rmsd_free(&rmsd);
+    }
+    unlockTop(top);
+}
+
+// Finds the k poses closest to the reference on nthreads threads, 0 meaning one thread per core
+// The RMSD of the k-th best pose so far bounds the search of the next poses, which are abandoned as soon as they
+// can't beat it: only the kept poses are searched to their optimal mapping
+// Fills results and indices with them by increasing RMSD, ties by pose index, and returns their number, at most k
+// Poses that can't be read or mapped are left out, results are freed with dock_rmsd_free
+int dock_rmsd_top_k(const DockRMSDReference *ref, const Mol2Source *poses, int count, int k, int nthreads, DockRMSD *results, int *indices)
+{
+    if (k <= 0)
+    {
+        return 0;
+    }
+    TopJob top;
+    top.ref = ref;
+    top.poses = poses;
+    top.k = k;
+    top.kept = 0;
+    top.results = results;
+    top.indices = indices;
+#ifdef _WIN32
+    InitializeCriticalSection(&top.lock);
+#else
+    pthread_mutex_init(&top.lock, NULL);
+#endif
+    parallelFor(count, nthreads, topJob, &top);
+#ifdef _WIN32
+    DeleteCriticalSection(&top.lock);
+#else
+    pthread_mutex_destroy(&top.lock);
+#endif
+    return top.kept;
+}
+
 // int main(int argc, char const *argv[])
 // {
 //     FILE *query = fopen(argv[1], "r");
@@ -872,8 +3972,8 @@ DockRMSD assignAtoms(char **tempatom, char ***tempbond,
 //     printf("rmsd = %f\n", val.rmsd);
 //     printf("error = %s\n", val.error);
 //     printf("total_of_possible_mappings = %f\n", val.total_of_possible_mappings);
-//     if (strlen(val.optimal_mapping) > 0)
-//         printf("optimal_mapping = \n%s", val.optimal_mapping);
-//     free(val.optimal_mapping);
+//     if (val.mapping)
+//         printf("optimal_mapping = \n%s", dock_rmsd_mapping_text(&val));
+//     dock_rmsd_free(&val);
 //     return 0;
 // }
\ No newline at end of file
@@ -1,21 +1,391 @@
 import os
 import cython
+from typing import List
 from libc.stdio cimport *  # noqa: E999
+from libc.stdlib cimport calloc, free
+from libc.string cimport memset, strcmp
+from cpython.buffer cimport PyBUF_WRITABLE
 
-cdef extern from "stdio.h":
+cdef extern from "stdio.h" nogil:
     # FILE * fopen ( const char * filename, const char * mode )
     FILE * fopen(const char * , const char * )  # noqa: E203, E202
     # int fclose ( FILE * stream )
     int fclose(FILE * )  # noqa: E203, E202
 
-cdef extern from "./DockRMSD_sources/DockRMSD.c":
+cdef extern from "./DockRMSD_sources/DockRMSD.c" nogil:
     # int grabAtomCount(FILE * , size_t * )  # noqa: E203, E202
     ctypedef struct DockRMSD:
-        float rmsd
-        float total_of_possible_mappings
+        double rmsd
+        double total_of_possible_mappings
         char * optimal_mapping
         char * error
+        int _querycount
+        double setup_seconds
+        double search_seconds
+        int * mapping
+        int within_threshold
+        int optimal
+        double lower_bound
+    ctypedef struct Molecule:
+        int atomcount
+    ctypedef struct DockRMSDReference:
+        Molecule mol
+        int depth
+    ctypedef struct Mol2Reader:
+        pass
+    ctypedef struct Mol2Source:
+        const char * path
+        const char * data
+        size_t size
+    ctypedef struct DockRMSDOptions:
+        int depth
+        int hungarian
+        int threads
+        double threshold
+        long long maxnodes
+        double timelimit
+    const int MAPPINGCOLUMNS
+    const char * QUERYREADERROR
+    const char * TEMPLATEREADERROR
+    const char * QUERYMOLECULEERROR
     DockRMSD dock_rmsd(FILE * , FILE * )  # noqa: E203, E202
+    DockRMSDReference * dock_rmsd_reference(FILE * )  # noqa: E203, E202
+    DockRMSDReference * dock_rmsd_reference_buffer(const char * , size_t)  # noqa: E203, E202, E501
+    DockRMSD dock_rmsd_pose(const DockRMSDReference * , FILE * )  # noqa: E203, E202, E501
+    DockRMSD dock_rmsd_pose_buffer(const DockRMSDReference * , const char * , size_t)  # noqa: E203, E202, E501
+    void dock_rmsd_reference_free(DockRMSDReference * )  # noqa: E203, E202
+    int dock_rmsd_reference_symmetry(const DockRMSDReference * , int * )  # noqa: E203, E202, E501
+    void dock_rmsd_clear_cache()
+    void dock_rmsd_free(DockRMSD * )  # noqa: E203, E202
+    const char * dock_rmsd_mapping_text(DockRMSD * )  # noqa: E203, E202
+    DockRMSDOptions dock_rmsd_default_options()
+    int dock_rmsd_reference_set_options(DockRMSDReference * , const DockRMSDOptions * )  # noqa: E203, E202, E501
+    Mol2Reader * dock_rmsd_stream(FILE * )  # noqa: E203, E202
+    Mol2Reader * dock_rmsd_stream_buffer(const char * , size_t)  # noqa: E203, E202, E501
+    int dock_rmsd_stream_next(const DockRMSDReference * , Mol2Reader * , DockRMSD * )  # noqa: E203, E202, E501
+    void dock_rmsd_stream_free(Mol2Reader * )  # noqa: E203, E202
+    void dock_rmsd_batch(const Mol2Source * , const Mol2Source * , DockRMSD * , int, int, const DockRMSDOptions * )  # noqa: E203, E202, E501
+    void dock_rmsd_pairwise(const Mol2Source * , int, double * , int, const DockRMSDOptions * )  # noqa: E203, E202, E501
+    int dock_rmsd_top_k(const DockRMSDReference * , const Mol2Source * , int, int, int, DockRMSD * , int * )  # noqa: E203, E202, E501
+
+
+cdef FILE * open_mol2(mol_path) except NULL:
+    mol_path_byte_string: bytes = os.fsencode(mol_path)
+    cdef char * molpath = mol_path_byte_string
+    cdef FILE * cfile = fopen(molpath, "r")
+    if cfile == NULL:
+        raise FileNotFoundError(
+            2, "No such file or directory: '%s'", mol_path)
+    return cfile
+
+
+cdef inline bint is_mol2_path(mol2):
+    """str and os.PathLike are paths, any other buffer is mol2 content"""
+    return isinstance(mol2, (str, os.PathLike))
+
+
+cdef const unsigned char[::1] mol2_buffer(mol2):
+    """Zero-copy view on the bytes of a bytes, bytearray, memoryview or mmap"""
+    return memoryview(mol2).cast("B")
+
+
+cdef inline const char * buffer_data(const unsigned char[::1] view):
+    if view.shape[0] == 0:
+        return ""
+    return <const char *> &view[0]
+
+
+cdef int set_options(DockRMSDOptions * options, int depth,
+                     bint hungarian, int threads=1,
+                     double threshold=0, long long max_nodes=0,
+                     double time_limit=0) except -1:
+    """Options of a comparison, depth 0 picks the depth adaptively"""
+    if max_nodes < 0 or time_limit < 0:
+        raise ValueError(
+            "max_nodes and time_limit must be positive, or 0 for no limit")
+    if threshold < 0:
+        raise ValueError(
+            "threshold must be positive, or 0 for the exact RMSD")
+    if depth < 0:
+        raise ValueError(
+            "depth must be positive, or 0 for the adaptive depth")
+    if threads < 0:
+        raise ValueError(
+            "n_threads must be positive, or 0 for one thread per core")
+    options[0] = dock_rmsd_default_options()
+    options.depth = depth
+    options.hungarian = hungarian
+    options.threads = threads
+    options.threshold = threshold
+    options.maxnodes = max_nodes
+    options.timelimit = time_limit
+    return 0
+
+
+cdef DockRMSDReference * prepare_reference(mol2, int depth=2,
+                                           bint hungarian=False,
+                                           int threads=1,
+                                           double threshold=0,
+                                           long long max_nodes=0,
+                                           double time_limit=0,
+                                           bint required=True) except? NULL:
+    """Prepared reference of the first molecule of mol2. Without one it
+    raises ValueError, or returns NULL when not required"""
+    cdef FILE * cfile
+    cdef const unsigned char[::1] view
+    cdef const char * data
+    cdef size_t size
+    cdef DockRMSDReference * ref
+    cdef DockRMSDOptions options
+    cdef int configured
+    set_options(&options, depth, hungarian, threads, threshold, max_nodes,
+                time_limit)
+    if is_mol2_path(mol2):
+        cfile = open_mol2(mol2)
+        with nogil:
+            ref = dock_rmsd_reference(cfile)
+            fclose(cfile)
+    else:
+        view = mol2_buffer(mol2)
+        data = buffer_data(view)
+        size = view.shape[0]
+        with nogil:
+            ref = dock_rmsd_reference_buffer(data, size)
+    if ref == NULL:
+        if not required:
+            return NULL
+        raise ValueError(QUERYMOLECULEERROR.decode("UTF-8"))
+    with nogil:
+        configured = dock_rmsd_reference_set_options(ref, &options)
+    if not configured:
+        dock_rmsd_reference_free(ref)
+        raise MemoryError()
+    return ref
+
+
+cdef DockRMSD score_pose(const DockRMSDReference * ref, mol2) except *:
+    cdef FILE * cfile
+    cdef const unsigned char[::1] view
+    cdef const char * data
+    cdef size_t size
+    cdef DockRMSD result
+    if is_mol2_path(mol2):
+        cfile = open_mol2(mol2)
+        with nogil:
+            result = dock_rmsd_pose(ref, cfile)
+            fclose(cfile)
+    else:
+        view = mol2_buffer(mol2)
+        data = buffer_data(view)
+        size = view.shape[0]
+        with nogil:
+            result = dock_rmsd_pose_buffer(ref, data, size)
+    return result
+
+
+cdef object set_source(Mol2Source * source, mol2):
+    """Points a batch source at a path or a buffer,
+    returns the object that keeps its memory alive"""
+    cdef const unsigned char[::1] view
+    if is_mol2_path(mol2):
+        mol_path_byte_string: bytes = os.fsencode(mol2)
+        source.path = mol_path_byte_string
+        source.data = NULL
+        source.size = 0
+        return mol_path_byte_string
+    view = mol2_buffer(mol2)
+    source.path = NULL
+    source.data = buffer_data(view)
+    source.size = view.shape[0]
+    return view
+
+
+@cython.embedsignature(True)
+@cython.binding(True)
+def clear_cache():
+    """Empty the cache of reference automorphisms shared by every call
+
+    The automorphisms of the last references are kept to be reused by
+    the next references with the same atoms and bonds, whatever their
+    coordinates.
+    """
+    with nogil:
+        dock_rmsd_clear_cache()
+
+
+@cython.embedsignature(True)
+@cython.binding(True)
+def batch_rmsd(pairs, n_threads: int = 0, depth: int = 2,
+               hungarian: bool = False, threshold: float = 0,
+               max_nodes: int = 0, time_limit: float = 0):
+    """Compute the RMSD of many (query, template) pairs on a native thread pool
+
+    The GIL is released for the whole batch, every pair being computed
+    independently on n_threads threads.
+
+    Parameters
+    ----------
+
+        pairs: Iterable[Tuple[mol2, mol2]]
+            (first, second) molecules as accepted by PyDockRMSD,
+            paths or bytes-like mol2 content
+
+        n_threads: int
+            number of threads, 0 uses one thread per core
+
+        depth: int
+            depth of the bonding trees compared to prune the candidates,
+            see PyDockRMSD
+
+        hungarian: bool
+            bond-agnostic assignment of the atoms, see PyDockRMSD
+
+        threshold: float
+            threshold mode, see PyDockRMSD: an RMSD, in double
+            precision, is at most threshold exactly when within_threshold
+            of the pair is True
+
+        max_nodes: int
+            search limit of every pair, see PyDockRMSD
+
+        time_limit: float
+            search limit of every pair in seconds, see PyDockRMSD
+
+    Returns
+    -------
+
+        numpy.ndarray
+            float64 RMSD of every pair in order,
+            nan when no mapping exists between the two molecules
+    """
+    import numpy
+    pairs = list(pairs)
+    cdef int count = len(pairs)
+    cdef int threads = n_threads
+    cdef DockRMSDOptions options
+    if threads < 0:
+        raise ValueError(
+            "n_threads must be positive, or 0 for one thread per core")
+    set_options(&options, depth, hungarian, 1, threshold, max_nodes,
+                time_limit)
+    cdef Mol2Source * queries = <Mol2Source *> calloc(count + 1, sizeof(Mol2Source))  # noqa: E501
+    cdef Mol2Source * templates = <Mol2Source *> calloc(count + 1, sizeof(Mol2Source))  # noqa: E501
+    cdef DockRMSD * results = <DockRMSD *> calloc(count + 1, sizeof(DockRMSD))
+    cdef double[::1] rmsds
+    cdef int i
+    keepalive = []
+    try:
+        if queries == NULL or templates == NULL or results == NULL:
+            raise MemoryError()
+        for i in range(count):
+            query, template = pairs[i]
+            keepalive.append(set_source(&queries[i], query))
+            keepalive.append(set_source(&templates[i], template))
+        with nogil:
+            dock_rmsd_batch(queries, templates, results, count, threads,
+                            &options)
+        rmsd_array = numpy.empty(count, dtype=numpy.float64)
+        rmsds = rmsd_array
+        for i in range(count):
+            if not strcmp(results[i].error, QUERYREADERROR):
+                raise FileNotFoundError(
+                    2, "No such file or directory: '%s'", pairs[i][0])
+            if not strcmp(results[i].error, TEMPLATEREADERROR):
+                raise FileNotFoundError(
+                    2, "No such file or directory: '%s'", pairs[i][1])
+            if results[i].mapping == NULL:
+                rmsds[i] = float("nan")
+            else:
+                rmsds[i] = results[i].rmsd
+        return rmsd_array
+    finally:
+        if results != NULL:
+            for i in range(count):
+                dock_rmsd_free(&results[i])
+        free(results)
+        free(queries)
+        free(templates)
+
+
+@cython.embedsignature(True)
+@cython.binding(True)
+def pairwise_rmsd(poses, n_threads: int = 0, depth: int = 2,
+                  hungarian: bool = False):
+    """Compute the RMSD between every two poses of one molecule,
+    as the condensed distance matrix of scipy.cluster.hierarchy
+
+    Every pose is parsed and prepared once, the symmetries of the molecule
+    are computed for the first pose and reused by the others. The pairs
+    i < j are computed on a native thread pool with the GIL released.
+
+    Parameters
+    ----------
+
+        poses: Iterable[mol2]
+            poses as accepted by PyDockRMSD, paths or bytes-like content
+
+        n_threads: int
+            number of threads, 0 uses one thread per core
+
+        depth: int
+            depth of the bonding trees compared to prune the candidates,
+            see PyDockRMSD
+
+        hungarian: bool
+            bond-agnostic assignment of the atoms, see PyDockRMSD
+
+    Returns
+    -------
+
+        numpy.ndarray
+            float64 RMSD of every pair i < j, at index
+            n * i - i * (i + 1) / 2 + j - i - 1 for n poses
+            (scipy.spatial.distance.squareform gives the square matrix),
+            nan when no mapping exists between the two poses
+
+    Raises
+    ------
+
+        FileNotFoundError
+            when a path doesn't exist
+
+    Example
+    -------
+
+        from scipy.cluster.hierarchy import linkage, fcluster
+        clusters = fcluster(linkage(pairwise_rmsd(poses), "average"),
+                            2.0, "distance")
+    """
+    import numpy
+    poses = list(poses)
+    cdef int count = len(poses)
+    cdef int threads = n_threads
+    cdef DockRMSDOptions options
+    if threads < 0:
+        raise ValueError(
+            "n_threads must be positive, or 0 for one thread per core")
+    set_options(&options, depth, hungarian)
+    for pose in poses:
+        if is_mol2_path(pose) and not os.path.isfile(pose):
+            raise FileNotFoundError(
+                2, "No such file or directory: '%s'", pose)
+    rmsd_array = numpy.empty(count * (count - 1) // 2, dtype=numpy.float64)
+    if count < 2:
+        return rmsd_array
+    cdef double[::1] rmsds = rmsd_array
+    cdef Mol2Source * sources = <Mol2Source *> calloc(count + 1, sizeof(Mol2Source))  # noqa: E501
+    cdef int i
+    keepalive = []
+    try:
+        if sources == NULL:
+            raise MemoryError()
+        for i in range(count):
+            keepalive.append(set_source(&sources[i], poses[i]))
+        with nogil:
+            dock_rmsd_pairwise(sources, count, &rmsds[0], threads, &options)
+        return rmsd_array
+    finally:
+        free(sources)
 
 
 @cython.embedsignature(True)
@@ -30,11 +400,55 @@ cdef class PyDockRMSD:
     Parameters
     ----------
 
-        first_mol_path: str
-            os.path to the mol2 file
+        first_mol_path: str | os.PathLike | bytes-like
+            os.path to the mol2 file, or the mol2 content itself as bytes,
+            bytearray, memoryview or mmap (read in place, without copy)
+
+        second_mol_path: str | os.PathLike | bytes-like
+            os.path to the mol2 file, or the mol2 content itself
+
+        depth: int
+            depth of the bonding trees compared to tell which atoms of
+            the second molecule can be mapped on each atom of the first.
+            Deeper trees prune more candidates before the mapping search,
+            0 deepens them until they stop telling apart more atoms of
+            the first molecule (adaptive mode), 2 by default
+
+        hungarian: bool
+            map each atom on the closest template atom of the same element
+            with the Hungarian algorithm, ignoring the bonds (the RMSD of
+            pydockrmsd.hungarian), False by default
 
-        second_mol_path: str
-            os.path to the mol2 file
+        n_threads: int
+            threads sharing the mapping search, 0 for one thread per core.
+            The search is only shared once one thread has walked 65536
+            nodes without completing it, and never when the poses are
+            mapped through the automorphisms of the first molecule: worth
+            it for large molecules whose symmetries could not be computed.
+            The optimal mapping is the same as with 1 thread, the default
+
+        threshold: float
+            threshold mode when positive: only tell whether the RMSD is
+            within threshold Angstroms (within_threshold). The search stops
+            at the first mapping within it, or as soon as a lower bound
+            proves there is none, and rmsd is the one of the best mapping
+            found so far. 0, the default, computes the exact RMSD
+
+        max_nodes: int
+            nodes the mapping search may visit, 0 for no limit (the
+            default). Once reached the search stops and rmsd is the one of
+            the best mapping found so far: optimal tells whether it was
+            proven to be the lowest, lower_bound is an RMSD no mapping is
+            below. The search over the automorphisms of the reference
+            counts its nodes too. With several threads the nodes of all of
+            them count, except the ones walked to split the search between
+            them, and each thread adds its nodes 256 at a time: the others
+            may go up to 255 nodes past the limit
+
+        time_limit: float
+            seconds the mapping search may last, 0 for no limit (the
+            default), stopping it like max_nodes. The clock is read every
+            256 nodes, a search of fewer nodes always completes
 
     Returns
     -------
@@ -44,6 +458,10 @@ cdef class PyDockRMSD:
             - rmsd : float
             - total_of_possible_mappings : float
             - optimal_mapping : str
+            - mapping : numpy.ndarray
+            - within_threshold : bool
+            - optimal : bool
+            - lower_bound : float
             - error : str
 
     C file Written by Eric Bell \
@@ -58,26 +476,76 @@ cdef class PyDockRMSD:
 
     """  # noqa: E501
     cdef DockRMSD data
+    cdef Py_ssize_t shape[2]
+    cdef Py_ssize_t strides[2]
 
     def __init__(self,
-                 first_mol_path: str,
-                 second_mol_path: str):
-        first_mol_path_byte_string: bytes = first_mol_path.encode("UTF-8")
-        cdef char * firstmolpath = first_mol_path_byte_string
+                 first_mol_path,
+                 second_mol_path,
+                 depth: int = 2,
+                 hungarian: bool = False,
+                 n_threads: int = 1,
+                 threshold: float = 0,
+                 max_nodes: int = 0,
+                 time_limit: float = 0):
         cdef FILE * first_cfile
-        first_cfile = fopen(firstmolpath, "r")
-        if first_cfile == NULL:
-            raise FileNotFoundError(
-                2, "No such file or directory: '%s'", first_mol_path)
-
-        second_mol_path_byte_string: bytes = second_mol_path.encode("UTF-8")
-        cdef char * secondmolpath = second_mol_path_byte_string
         cdef FILE * second_cfile
-        second_cfile = fopen(secondmolpath, "r")
-        if second_cfile == NULL:
-            raise FileNotFoundError(
-                2, "No such file or directory: '%s'", second_mol_path)
-        self.data = dock_rmsd(first_cfile, second_cfile)
+        cdef DockRMSDReference * ref
+        cdef DockRMSD data
+        if is_mol2_path(first_mol_path) and is_mol2_path(second_mol_path) \
+                and depth == 2 and not hungarian and n_threads == 1 \
+                and not threshold and not max_nodes and not time_limit:
+            first_cfile = open_mol2(first_mol_path)
+            try:
+                second_cfile = open_mol2(second_mol_path)
+            except FileNotFoundError:
+                fclose(first_cfile)
+                raise
+            with nogil:
+                data = dock_rmsd(first_cfile, second_cfile)
+            self.data = data
+            return
+        ref = prepare_reference(first_mol_path, depth, hungarian, n_threads,
+                                threshold, max_nodes, time_limit, False)
+        if ref == NULL:
+            # The error result of dock_rmsd, the second path still has to
+            # exist
+            if is_mol2_path(second_mol_path):
+                fclose(open_mol2(second_mol_path))
+            self.data.optimal_mapping = <char *> ""
+            self.data.error = <char *> QUERYMOLECULEERROR
+            return
+        try:
+            self.data = score_pose(ref, second_mol_path)
+        finally:
+            dock_rmsd_reference_free(ref)
+
+    def __dealloc__(self):
+        dock_rmsd_free(&self.data)
+
+    def __getbuffer__(self, Py_buffer * buffer, int flags):
+        if self.data.mapping == NULL:
+            raise BufferError("No mapping")
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("The mapping is read-only")
+        self.shape[0] = self.data._querycount
+        self.shape[1] = MAPPINGCOLUMNS
+        self.strides[0] = MAPPINGCOLUMNS * sizeof(int)
+        self.strides[1] = sizeof(int)
+        buffer.buf = self.data.mapping
+        buffer.obj = self
+        buffer.len = self.shape[0] * self.shape[1] * sizeof(int)
+        buffer.readonly = 1
+        buffer.itemsize = sizeof(int)
+        buffer.format = "i"
+        buffer.ndim = 2
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer * buffer):
+        pass
 
     @property
     def rmsd(self) -> float:
@@ -92,10 +560,277 @@ cdef class PyDockRMSD:
     def optimal_mapping(self) -> str:
         """Find the deterministically optimal mapping between query and template
         atoms, an exhaustive assignment search reminiscent of the VF2 algorithm
-        coupled with Dead-End Elimination (DEE) is implemented."""
-        return self.data.optimal_mapping.decode("UTF-8")
+        coupled with Dead-End Elimination (DEE) is implemented.
+
+        The text is rendered from mapping on first access."""
+        return dock_rmsd_mapping_text(&self.data).decode("UTF-8")
+
+    @property
+    def mapping(self):
+        """Optimal mapping as a read-only int32 array of shape (atoms, 3),
+        one row per heavy atom of the first molecule in file order: index of
+        the heavy atom of the second molecule it is mapped on, then the mol2
+        atom numbers of both atoms. The array shares the memory of the
+        result, without copy. None if no mapping exists : numpy.ndarray"""
+        if self.data.mapping == NULL:
+            return None
+        import numpy
+        return numpy.asarray(self)
+
+    @property
+    def within_threshold(self) -> bool:
+        """Whether the RMSD is within the threshold, always False when the
+        threshold mode is off : bool"""
+        return self.data.within_threshold != 0
+
+    @property
+    def optimal(self) -> bool:
+        """Whether rmsd was proven to be the lowest, False when a search
+        limit or the threshold mode stopped the search first : bool"""
+        return self.data.optimal != 0
+
+    @property
+    def lower_bound(self) -> float:
+        """RMSD no mapping is below, rmsd itself when optimal : float"""
+        return self.data.lower_bound
 
     @property
     def error(self) -> str:
         """Return empty str if no error was found: str"""
-        return self.data.error.decode("UTF-8")
\ No newline at end of file
+        return self.data.error.decode("UTF-8")
+
+    @property
+    def setup_seconds(self) -> float:
+        """Seconds spent preparing the mapping search: bonding trees of the
+        second molecule, candidates, their distances and the assignment
+        the search starts from : float"""
+        return self.data.setup_seconds
+
+    @property
+    def search_seconds(self) -> float:
+        """Seconds spent in the mapping search itself : float"""
+        return self.data.search_seconds
+
+
+@cython.embedsignature(True)
+@cython.binding(True)
+cdef class PyDockRMSDReference:
+    """PyDockRMSDReference
+    Reference molecule (usually the crystal pose) prepared once to be
+    compared against many docked poses.
+
+    The reference is parsed and its bonding trees are computed a single time,
+    each pose then only costs its own parsing and the mapping search.
+    The reference is never modified by the comparisons and the GIL is
+    released while they run, so one reference can be shared between threads.
+
+    Parameters
+    ----------
+
+        reference_mol_path: str | os.PathLike | bytes-like
+            os.path to the mol2 file used as first file of every comparison,
+            or its content
+
+        depth: int
+            depth of the bonding trees, see PyDockRMSD,
+            0 picks it adaptively from the reference
+
+        hungarian: bool
+            bond-agnostic assignment of the atoms, see PyDockRMSD
+
+        n_threads: int
+            threads sharing the mapping search of every pose,
+            see PyDockRMSD
+
+        threshold: float
+            threshold mode for every pose, see PyDockRMSD
+
+        max_nodes: int
+            search limit of every pose, see PyDockRMSD
+
+        time_limit: float
+            search limit of every pose in seconds, see PyDockRMSD
+
+    Example
+    -------
+
+        reference = PyDockRMSDReference("crystal.mol2")
+        reference.rmsd(["vina1.mol2", "vina2.mol2"])
+        [pose.rmsd for pose in reference.stream("vina_out.mol2")]
+
+    """
+    cdef DockRMSDReference * ref
+
+    def __cinit__(self):
+        self.ref = NULL
+
+    def __init__(self, reference_mol_path, depth: int = 2,
+                 hungarian: bool = False, n_threads: int = 1,
+                 threshold: float = 0, max_nodes: int = 0,
+                 time_limit: float = 0):
+        self.ref = prepare_reference(reference_mol_path, depth, hungarian,
+                                     n_threads, threshold, max_nodes,
+                                     time_limit)
+
+    def __dealloc__(self):
+        dock_rmsd_reference_free(self.ref)
+
+    @property
+    def depth(self) -> int:
+        """Depth of the bonding trees compared, the one picked by the
+        adaptive mode when the reference was built with depth 0 : int"""
+        return self.ref.depth
+
+    @property
+    def symmetry_classes(self) -> List[int]:
+        """Symmetry class of every heavy atom of the reference, in file order:
+        the index of the smallest atom a symmetry of the molecule can
+        exchange it with, None if the symmetries could not be computed.
+        Mappings are only searched up to these symmetries : List[int]"""
+        cdef int count = self.ref.mol.atomcount
+        cdef int * classes = <int *> calloc(count + 1, sizeof(int))
+        if classes == NULL:
+            raise MemoryError()
+        try:
+            if dock_rmsd_reference_symmetry(self.ref, classes) < 0:
+                return None
+            return [classes[i] for i in range(count)]
+        finally:
+            free(classes)
+
+    def dock_rmsd(self, pose_mol_path) -> PyDockRMSD:
+        """Compare one pose, given as a path or as mol2 content,
+        against the reference
+
+        Returns
+        -------
+
+            PyDockRMSD
+                same result as PyDockRMSD(reference_mol_path, pose_mol_path)
+        """
+        cdef PyDockRMSD result = PyDockRMSD.__new__(PyDockRMSD)
+        result.data = score_pose(self.ref, pose_mol_path)
+        return result
+
+    def rmsd(self, pose_mol_paths) -> List[float]:
+        """Return the RMSD of every pose against the reference : List[float]
+
+        Poses that cannot be mapped on the reference give nan,
+        use dock_rmsd to get their error."""
+        cdef PyDockRMSD result
+        rmsds: List[float] = []
+        for pose_mol_path in pose_mol_paths:
+            result = self.dock_rmsd(pose_mol_path)
+            if result.data.mapping == NULL:
+                rmsds.append(float("nan"))
+            else:
+                rmsds.append(result.data.rmsd)
+        return rmsds
+
+    def top_k(self, pose_mol_paths, k: int, n_threads: int = 0):
+        """Return the k poses closest to the reference : List[Tuple[int, PyDockRMSD]]
+
+        Poses are compared on a native thread pool with the GIL released.
+        The RMSD of the k-th best pose found so far bounds the search of
+        the next ones, which are abandoned as soon as they can't beat it:
+        only the returned poses are searched to their optimal mapping.
+
+        Parameters
+        ----------
+
+            pose_mol_paths: Iterable[mol2]
+                poses as accepted by dock_rmsd, paths or bytes-like content
+
+            k: int
+                number of poses to return
+
+            n_threads: int
+                number of threads, 0 uses one thread per core
+
+        Returns
+        -------
+
+            List[Tuple[int, PyDockRMSD]]
+                (index of the pose, result) by increasing RMSD, ties by
+                index. Fewer than k when fewer poses can be mapped
+        """
+        poses = list(pose_mol_paths)
+        cdef int count = len(poses)
+        cdef int best = min(k, count)
+        cdef int threads = n_threads
+        cdef int kept = 0
+        cdef PyDockRMSD result
+        cdef int i
+        if k < 0:
+            raise ValueError("k must be positive")
+        if threads < 0:
+            raise ValueError(
+                "n_threads must be positive, or 0 for one thread per core")
+        for pose in poses:
+            if is_mol2_path(pose) and not os.path.isfile(pose):
+                raise FileNotFoundError(
+                    2, "No such file or directory: '%s'", pose)
+        cdef Mol2Source * sources = <Mol2Source *> calloc(count + 1, sizeof(Mol2Source))  # noqa: E501
+        cdef DockRMSD * results = <DockRMSD *> calloc(best + 1, sizeof(DockRMSD))
+        cdef int * indices = <int *> calloc(best + 1, sizeof(int))
+        keepalive = []
+        top = []
+        try:
+            if sources == NULL or results == NULL or indices == NULL:
+                raise MemoryError()
+            for i in range(count):
+                keepalive.append(set_source(&sources[i], poses[i]))
+            with nogil:
+                kept = dock_rmsd_top_k(self.ref, sources, count, best,
+                                       threads, results, indices)
+            for i in range(kept):
+                result = PyDockRMSD.__new__(PyDockRMSD)
+                result.data = results[i]
+                # Owned by result from now on
+                memset(&results[i], 0, sizeof(DockRMSD))
+                top.append((indices[i], result))
+            return top
+        finally:
+            for i in range(kept):
+                dock_rmsd_free(&results[i])
+            free(sources)
+            free(results)
+            free(indices)
+
+    def stream(self, poses_mol_path):
+        """Compare every @<TRIPOS>MOLECULE block of a multi-molecule mol2
+        file, or mol2 content, against the reference, reading it once
+
+        Yields
+        ------
+
+            PyDockRMSD
+                one result per pose, in file order
+        """
+        cdef FILE * poses_cfile = NULL
+        cdef const unsigned char[::1] view
+        cdef Mol2Reader * reader
+        cdef PyDockRMSD result
+        cdef DockRMSD data
+        cdef int more
+        if is_mol2_path(poses_mol_path):
+            poses_cfile = open_mol2(poses_mol_path)
+            reader = dock_rmsd_stream(poses_cfile)
+        else:
+            view = mol2_buffer(poses_mol_path)
+            reader = dock_rmsd_stream_buffer(buffer_data(view), view.shape[0])
+        try:
+            if reader == NULL:
+                raise MemoryError()
+            while True:
+                with nogil:
+                    more = dock_rmsd_stream_next(self.ref, reader, &data)
+                if not more:
+                    break
+                result = PyDockRMSD.__new__(PyDockRMSD)
+                result.data = data
+                yield result
+        finally:
+            dock_rmsd_stream_free(reader)
+            if poses_cfile != NULL:
+                fclose(poses_cfile)
@@ -46,7 +46,7 @@ setup(
     # url='https://www.python.org/sigs/distutils-sig/',
     ext_modules=cythonize(extensions, annotate=False),
     python_requires=">=3.6",
-    install_requires=[],
+    install_requires=["numpy"],
     classifiers=[
         # How mature is this project ? Common values are
         #   3 - Alpha
@@ -0,0 +1,59 @@
+// Compares the mapping search split between threads with the serial one, built by tests/test_dockrmsd.py with a low
+// PARALLELNODES for small molecules to be split too
+// Arguments: the thread count then the first and second molecule of every pair
+// Prints the pairs whose search was split and the pairs whose RMSD or mapping differs
+#include "DockRMSD.c"
+
+static DockRMSD scoreFile(const DockRMSDReference *ref, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    Mol2Reader reader = fileReader(file);
+    Molecule temp;
+    readNextMolecule(&reader, &temp, 0);
+    fclose(file);
+    DockRMSD result = scorePose(ref, &temp, NULL, DBL_MAX);
+    freeMolecule(&temp);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = atoi(argv[1]);
+    int parallel = 0, differ = 0;
+    for (int arg = 2; arg + 1 < argc; arg += 2)
+    {
+        FILE *file = fopen(argv[arg], "r");
+        DockRMSDReference *ref = dock_rmsd_reference(file);
+        fclose(file);
+        // Without the automorphisms every pose is mapped by the search that can be split
+        Symmetry symmetry[2] = {ref->symmetry[0], ref->symmetry[1]};
+        ref->symmetry[0].levels = -1;
+        ref->symmetry[1].levels = -1;
+        // The node count being exact on one thread, the search is split when PARALLELNODES nodes don't complete it
+        ref->options.threads = 1;
+        ref->options.maxnodes = PARALLELNODES;
+        DockRMSD limited = scoreFile(ref, argv[arg + 1]);
+        ref->options.maxnodes = 0;
+        DockRMSD serial = scoreFile(ref, argv[arg + 1]);
+        ref->options.threads = nthreads;
+        DockRMSD split = scoreFile(ref, argv[arg + 1]);
+        if (limited.mapping && !limited.optimal)
+        {
+            parallel++;
+        }
+        if (serial.rmsd != split.rmsd || (serial.mapping == NULL) != (split.mapping == NULL) ||
+            (serial.mapping && strcmp(dock_rmsd_mapping_text(&serial), dock_rmsd_mapping_text(&split))))
+        {
+            printf("%s differs\n", argv[arg + 1]);
+            differ++;
+        }
+        dock_rmsd_free(&limited);
+        dock_rmsd_free(&serial);
+        dock_rmsd_free(&split);
+        ref->symmetry[0] = symmetry[0];
+        ref->symmetry[1] = symmetry[1];
+        dock_rmsd_reference_free(ref);
+    }
+    printf("%d %d\n", parallel, differ);
+    return 0;
+}
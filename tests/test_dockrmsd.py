@@ -0,0 +1,290 @@
+"""Checks of pydockrmsd against the values published with DockRMSD and
+between its entry points, on the CSAR Hi-Q poses of examples/data.
+
+Build the extension in place before running them:
+
+    python setup.py build_ext --inplace
+    python -m pytest tests
+"""
+import math
+import pathlib
+import shlex
+import subprocess
+import sys
+import sysconfig
+
+import numpy
+import pytest
+
+from pydockrmsd.dockrmsd import (PyDockRMSD, PyDockRMSDReference,
+                                 batch_rmsd, pairwise_rmsd)
+from pydockrmsd.hungarian import hungarian
+
+TESTS = pathlib.Path(__file__).resolve().parent
+DATA = TESTS.parent / "examples" / "data"
+TARGETS = DATA / "targets"
+TARGET_NAMES = (TARGETS / "protlist").read_text().split()
+# Targets checked by the slower tests, spread over the whole set
+SAMPLE = TARGET_NAMES[::7]
+POSE_PAIRS = [(i, j) for i in range(1, 6) for j in range(i + 1, 6)]
+
+
+def pose(target, index):
+    return str(TARGETS / target / ("vina%d.mol2" % index))
+
+
+def crystal(target):
+    return str(TARGETS / target / "crystal.mol2")
+
+
+def published_rmsds(depth):
+    """RMSD of every pair of vina poses of every target, in POSE_PAIRS
+    order, as published with DockRMSD for a neighbor depth"""
+    rmsds = {}
+    target = None
+    for line in (DATA / ("%d.txt" % depth)).read_text().splitlines():
+        if line.startswith("./"):
+            target = line.strip("./")
+            rmsds[target] = []
+        elif target is not None and line[:1].isdigit():
+            # The files start and end with the date of the run
+            rmsds[target].append(float(line))
+    return rmsds
+
+
+def exact(first, second, **options):
+    """RMSD of PyDockRMSD, nan when there is no mapping"""
+    result = PyDockRMSD(first, second, **options)
+    return result.rmsd if result.optimal_mapping else math.nan
+
+
+def same(first, second):
+    return first == second or (math.isnan(first) and math.isnan(second))
+
+
+# The values of depth 1 come from an earlier DockRMSD: the DockRMSD.c shipped
+# with them gives the same RMSDs as pydockrmsd at that depth
+@pytest.mark.parametrize("depth", [2, 3, 4, 5, 10])
+def test_published_pose_pairs(depth):
+    published = published_rmsds(depth)
+    assert list(published) == TARGET_NAMES
+    compared = 0
+    for target in TARGET_NAMES:
+        for (i, j), expected in zip(POSE_PAIRS, published[target]):
+            result = PyDockRMSD(pose(target, i), pose(target, j),
+                                depth=depth)
+            if not result.optimal_mapping:
+                # vina1 of a few targets has a bonding error the others
+                # don't have, see oldvina1.mol2
+                continue
+            assert result.rmsd == pytest.approx(expected, abs=5e-6), \
+                (target, i, j)
+            compared += 1
+    assert compared > 3400
+
+
+def test_published_crystal_pairs():
+    lines = (DATA / "compare" / "crystal.txt").read_text().split()
+    assert len(lines) == len(TARGET_NAMES)
+    for target, line in zip(TARGET_NAMES, lines):
+        dockrmsd, hungarian_rmsd = map(float, line.split(","))
+        result = PyDockRMSD(crystal(target), pose(target, 1))
+        assert result.optimal_mapping, target
+        # Published with 3 decimals, the Hungarian ones from distances
+        # quantized to 1e-4
+        assert result.rmsd == pytest.approx(dockrmsd, abs=5e-4), target
+        assert hungarian(crystal(target), pose(target, 1)) == \
+            pytest.approx(hungarian_rmsd, abs=1e-3), target
+
+
+def test_mapping_rows():
+    target = TARGET_NAMES[0]
+    result = PyDockRMSD(crystal(target), pose(target, 1))
+    mapping = result.mapping
+    assert mapping.shape[1] == 3
+    assert not mapping.flags.writeable
+    assert len(set(mapping[:, 0])) == len(mapping)
+    assert result.optimal_mapping.count("\n") >= len(mapping)
+
+
+@pytest.mark.parametrize("n_threads", [1, 4])
+def test_batch_matches_single_pairs(n_threads):
+    pairs = [(crystal(target), pose(target, i))
+             for target in TARGET_NAMES for i in range(1, 6)]
+    rmsds = batch_rmsd(pairs, n_threads=n_threads)
+    assert rmsds.dtype == numpy.float64
+    for pair, rmsd in zip(pairs, rmsds):
+        assert same(rmsd, exact(*pair)), pair
+
+
+@pytest.mark.skipif(sys.platform == "win32",
+                    reason="the driver is built with a Unix compiler")
+def test_parallel_search_matches_serial(tmp_path):
+    """The mapping search split between threads gives the serial mapping,
+    splitting after 64 nodes instead of 65536 for small poses to be split"""
+    driver = tmp_path / "parallel_search"
+    compiler = shlex.split(sysconfig.get_config_var("CC") or "cc")
+    sources = TESTS.parent / "pydockrmsd" / "DockRMSD_sources"
+    try:
+        subprocess.run(compiler + [
+            "-O2", "-DPARALLELNODES=64", "-I%s" % sources, "-o", str(driver),
+            str(TESTS / "parallel_search.c"), "-lm", "-lpthread"],
+            check=True, capture_output=True)
+    except (OSError, subprocess.CalledProcessError) as error:
+        pytest.skip("can't build the driver: %s" % error)
+    pairs = [path for target in TARGET_NAMES for i in range(1, 6)
+             for path in (crystal(target), pose(target, i))]
+    output = subprocess.run([str(driver), "4"] + pairs, check=True,
+                            capture_output=True, text=True).stdout
+    parallel, differ = map(int, output.split()[-2:])
+    assert differ == 0, output
+    assert parallel > 0
+
+
+def test_pairwise_matches_single_pairs():
+    for target in SAMPLE:
+        poses = [pose(target, i) for i in range(1, 6)]
+        condensed = pairwise_rmsd(poses, n_threads=2)
+        assert condensed.shape == (len(POSE_PAIRS),)
+        for (i, j), rmsd in zip(POSE_PAIRS, condensed):
+            assert same(rmsd, exact(pose(target, i), pose(target, j))), \
+                (target, i, j)
+
+
+def test_reference_matches_single_pairs():
+    for target in SAMPLE:
+        reference = PyDockRMSDReference(crystal(target))
+        poses = [pose(target, i) for i in range(1, 6)]
+        for path, rmsd in zip(poses, reference.rmsd(poses)):
+            assert same(rmsd, exact(crystal(target), path)), path
+
+
+@pytest.mark.parametrize("k", [1, 3, 5])
+def test_top_k_matches_sort(k):
+    for target in SAMPLE:
+        poses = [pose(target, i) for i in range(1, 6)]
+        rmsds = [exact(crystal(target), path) for path in poses]
+        expected = sorted((rmsd, index) for index, rmsd in enumerate(rmsds)
+                          if not math.isnan(rmsd))[:k]
+        top = PyDockRMSDReference(crystal(target)).top_k(poses, k,
+                                                          n_threads=2)
+        assert [(result.rmsd, index) for index, result in top] == \
+            expected, target
+
+
+@pytest.mark.parametrize("threshold", [1.0, 2.0, 4.0])
+def test_threshold_mode(threshold):
+    for target in SAMPLE:
+        for i in range(1, 6):
+            expected = exact(crystal(target), pose(target, i))
+            result = PyDockRMSD(crystal(target), pose(target, i),
+                                threshold=threshold)
+            if math.isnan(expected):
+                assert not result.within_threshold
+                continue
+            assert result.within_threshold == (expected <= threshold)
+            assert result.rmsd >= expected - 1e-9
+            if result.within_threshold:
+                assert result.rmsd <= threshold
+
+
+def test_threshold_batch_matches_flag():
+    threshold = 2.0
+    pairs = [(crystal(target), pose(target, i))
+             for target in SAMPLE for i in range(1, 6)]
+    rmsds = batch_rmsd(pairs, threshold=threshold)
+    for pair, rmsd in zip(pairs, rmsds):
+        within = PyDockRMSD(*pair, threshold=threshold).within_threshold
+        assert (rmsd <= threshold) == within, pair
+
+
+def test_threshold_off_is_never_within():
+    target = TARGET_NAMES[0]
+    result = PyDockRMSD(crystal(target), crystal(target), depth=3)
+    assert result.rmsd == 0
+    assert not result.within_threshold
+
+
+@pytest.mark.parametrize("n_threads", [1, 3])
+@pytest.mark.parametrize("max_nodes", [1, 300, 10 ** 9])
+def test_max_nodes(max_nodes, n_threads):
+    for target in SAMPLE:
+        for i in range(1, 6):
+            expected = exact(crystal(target), pose(target, i))
+            result = PyDockRMSD(crystal(target), pose(target, i),
+                                n_threads=n_threads, max_nodes=max_nodes)
+            if math.isnan(expected):
+                assert result.mapping is None
+                continue
+            assert result.mapping is not None
+            assert result.lower_bound <= expected + 1e-9
+            assert result.rmsd >= expected - 1e-9
+            if result.optimal:
+                assert result.rmsd == pytest.approx(expected, abs=1e-9)
+                assert result.lower_bound == pytest.approx(result.rmsd)
+            if max_nodes == 10 ** 9:
+                assert result.optimal
+
+
+def test_max_nodes_threads_agree():
+    """Several threads never lose what one thread finds within a budget"""
+    for target in SAMPLE:
+        for i in range(1, 6):
+            single = PyDockRMSD(crystal(target), pose(target, i),
+                                max_nodes=300)
+            threaded = PyDockRMSD(crystal(target), pose(target, i),
+                                  max_nodes=300, n_threads=3)
+            assert (single.mapping is None) == (threaded.mapping is None)
+            if single.optimal:
+                assert threaded.optimal
+                assert threaded.rmsd == single.rmsd
+
+
+def test_max_nodes_automorphisms():
+    """C60 poses numbered alike are searched through the automorphisms"""
+    c60 = DATA / "runtime" / "C60"
+    first, second = str(c60 / "vina1.mol2"), str(c60 / "vina2.mol2")
+    expected = exact(first, second)
+    result = PyDockRMSD(first, second, max_nodes=1)
+    assert not result.optimal
+    assert result.lower_bound <= expected + 1e-9 <= result.rmsd + 2e-9
+    assert PyDockRMSD(first, second, max_nodes=10 ** 6).optimal
+
+
+def test_time_limit():
+    for target in SAMPLE:
+        result = PyDockRMSD(crystal(target), pose(target, 1),
+                            time_limit=1e-9)
+        expected = exact(crystal(target), pose(target, 1))
+        if not math.isnan(expected):
+            assert result.lower_bound <= expected + 1e-9 <= \
+                result.rmsd + 2e-9
+
+
+@pytest.mark.parametrize("call", [
+    lambda: PyDockRMSD(crystal("10gs"), pose("10gs", 1), n_threads=-1),
+    lambda: PyDockRMSD(crystal("10gs"), pose("10gs", 1), threshold=-1),
+    lambda: PyDockRMSD(crystal("10gs"), pose("10gs", 1), max_nodes=-1),
+    lambda: batch_rmsd([], n_threads=-1),
+    lambda: pairwise_rmsd([], n_threads=-1),
+    lambda: PyDockRMSDReference(crystal("10gs")).top_k([], 1, n_threads=-1),
+])
+def test_invalid_arguments(call):
+    with pytest.raises(ValueError):
+        call()
+
+
+@pytest.mark.parametrize("options", [{}, {"depth": 3}, {"n_threads": 2}])
+def test_reference_without_molecule(tmp_path, options):
+    """A first molecule file without molecule gives an error result, read
+    from a path or a buffer, by the native comparison or a reference"""
+    empty = tmp_path / "empty.mol2"
+    empty.write_bytes(b"")
+    for first in [str(empty), b""]:
+        result = PyDockRMSD(first, pose("10gs", 1), **options)
+        assert result.error == "Error: Query file has no molecule!"
+        assert result.mapping is None
+        assert result.optimal_mapping == ""
+    assert math.isnan(batch_rmsd([(str(empty), pose("10gs", 1))])[0])
+    with pytest.raises(ValueError):
+        PyDockRMSDReference(b"", **options)